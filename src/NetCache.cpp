@@ -33,143 +33,391 @@
 
 #ifdef INCLUDE_NET_CACHE
 
-#define CTO_RXLEN  50 /* ms unit */
-#define CTO_STATE 100 /* ms unit */
-#define CTO_WRITE  50 /* ms unit */
+#define CTO_RXLEN   50 /* ms unit */
+#define CTO_STATE  100 /* ms unit */
+#define CTO_WRITE   50 /* ms unit */
+#define CTO_TXFREE 100 /* ms unit */
 
-#define CT_ID_RXLEN 0
-#define CT_ID_STATE 1
-#define CT_ID_WRITE 2
+#define CT_ID_RXLEN  0
+#define CT_ID_STATE  1
+#define CT_ID_WRITE  2
+#define CT_ID_TXFREE 3
+#define CT_ID_COUNT  4
 
-#define CT_FLAG_RUN_RXLEN 0x01
-#define CT_FLAG_RUN_STATE 0x02
-#define CT_FLAG_RUN_WRITE 0x04
-#define CT_FLAG_TO_RXLEN  0x10
-#define CT_FLAG_TO_STATE  0x20
-#define CT_FLAG_TO_WRITE  0x40
+#define CT_FLAG_RUN_RXLEN  0x01
+#define CT_FLAG_RUN_STATE  0x02
+#define CT_FLAG_RUN_WRITE  0x04
+#define CT_FLAG_RUN_TXFREE 0x08
+#define CT_FLAG_RUN_ALL    0x0f
+#define CT_FLAG_TO_RXLEN   0x10
+#define CT_FLAG_TO_STATE   0x20
+#define CT_FLAG_TO_WRITE   0x40
+#define CT_FLAG_TO_TXFREE  0x80
+
+#define CT_FLAG_RUN(ct_id) (CT_FLAG_RUN_RXLEN << (ct_id))
+#define CT_FLAG_TO(ct_id)  (CT_FLAG_TO_RXLEN << (ct_id))
+
+#define NC_WRITE_WAIT_MS 16 /* max. backoff time of waiting transmit credit */
+
+#define NC_POLL_EXPIRE_MS CTO_STATE /* poll mode ends if Phpoc.poll() is not called in time */
+
+#define NC_SPI_CHUNK_SIZE 1024 /* max. send/recv size, SPI data length field is 11bit(V2)/12bit(V1) */
+
+#define NC_FLAG_SKIP_REFILL 0x80 /* internal : large read bypasses read cache */
 
 /* global variables */
 uint8_t  nc_tcp_state[MAX_SOCK_TCP];
 uint16_t nc_tcp_rxlen[MAX_SOCK_TCP];
+uint16_t nc_tcp_txfree[MAX_SOCK_TCP];
+uint8_t  nc_close_mask; /* sockets waiting for TCP_CLOSED after stopAsync() */
+uint8_t  nc_state_mask; /* sockets whose tcp state has changed, cleared by reader */
+uint8_t  nc_state_seq;  /* incremented on every state change of any socket */
 uint8_t  nc_read_len[MAX_SOCK_TCP];
 uint8_t  nc_write_len[MAX_SOCK_TCP];
 uint8_t  nc_read_buf[MAX_SOCK_TCP][SOCK_READ_CACHE_SIZE];
 uint8_t  nc_write_buf[MAX_SOCK_TCP][SOCK_WRITE_CACHE_SIZE];
 
 /* local variables */
-static uint16_t ct_t1_rxlen[MAX_SOCK_TCP];
-static uint16_t ct_t1_state[MAX_SOCK_TCP];
-static uint16_t ct_t1_write[MAX_SOCK_TCP];
+static const uint8_t ct_timeout[CT_ID_COUNT] = { CTO_RXLEN, CTO_STATE, CTO_WRITE, CTO_TXFREE };
+static uint16_t ct_due_ms16[MAX_SOCK_TCP][CT_ID_COUNT];
 static uint8_t  ct_flags[MAX_SOCK_TCP];
+static uint16_t ct_next_ms16; /* earliest deadline of all running timers */
+static uint16_t ct_now_ms16;  /* millis() sampled once per nc_update() */
+static uint32_t ct_tick_ms;   /* millis() of last ct_tick() */
+static uint8_t  ct_armed;     /* one or more timers are running */
+static uint8_t  nc_polled;    /* sketch calls Phpoc.poll() */
+static uint32_t nc_poll_ms;   /* ct_tick_ms of last nc_poll() */
+static uint16_t nc_tcp_txbuf[MAX_SOCK_TCP]; /* 0 : not read yet */
+static uint8_t  nc_flush_next; /* first socket of next nc_flush_loop() */
+
+/* timer deadlines are kept in 16bit millisecond unit.
+ * timeout must be shorter than 32768ms to compare deadlines correctly.
+ */
+#define CT_BEFORE(t1_ms16, t2_ms16) ((int16_t)((t1_ms16) - (t2_ms16)) < 0)
 
-static uint16_t ct_elapsed_ms(uint16_t t1_ms16)
+static void ct_tick(void)
 {
-	uint16_t t2_ms16;
+	uint32_t now_ms;
+	uint8_t sock_id;
 
-	t2_ms16 = (uint16_t)millis();
+	now_ms = millis();
 
-	if(t2_ms16 >= t1_ms16)
-		return t2_ms16 - t1_ms16;
-	else
-		return (~t1_ms16 + 1) + t2_ms16;
+	/* 16bit deadlines can't be compared after long idle time(delay() in sketch).
+	 * all timers are older than 32768ms, so they are expired here.
+	 */
+	if((now_ms - ct_tick_ms) >= 0x8000)
+	{
+		for(sock_id = 0; sock_id < MAX_SOCK_TCP; sock_id++)
+		{
+			ct_flags[sock_id] |= (ct_flags[sock_id] & CT_FLAG_RUN_ALL) << 4; /* RUN to TO */
+			ct_flags[sock_id] &= ~CT_FLAG_RUN_ALL;
+		}
+
+		ct_armed = 0;
+	}
+
+	ct_tick_ms = now_ms;
+	ct_now_ms16 = (uint16_t)now_ms;
 }
 
 static void ct_start(uint8_t sock_id, uint8_t ct_id)
 {
-	uint16_t cur_ms16;
-
-	cur_ms16 = (uint16_t)millis();
+	uint16_t due_ms16;
 
-	switch(ct_id)
-	{
-		case CT_ID_RXLEN:
-			ct_t1_rxlen[sock_id] = cur_ms16;
-			ct_flags[sock_id] |= CT_FLAG_RUN_RXLEN;
-			break;
+	due_ms16 = ct_now_ms16 + ct_timeout[ct_id];
 
-		case CT_ID_STATE:
-			ct_t1_state[sock_id] = cur_ms16;
-			ct_flags[sock_id] |= CT_FLAG_RUN_STATE;
-			break;
+	ct_due_ms16[sock_id][ct_id] = due_ms16;
+	ct_flags[sock_id] |= CT_FLAG_RUN(ct_id);
 
-		case CT_ID_WRITE:
-			ct_t1_write[sock_id] = cur_ms16;
-			ct_flags[sock_id] |= CT_FLAG_RUN_WRITE;
-			break;
+	if(!ct_armed || CT_BEFORE(due_ms16, ct_next_ms16))
+	{
+		ct_next_ms16 = due_ms16;
+		ct_armed = 1;
 	}
 }
 
 static void ct_stop(uint8_t sock_id, uint8_t ct_id)
 {
-	switch(ct_id)
+	/* ct_next_ms16 is not updated here.
+	 * ct_loop() recalculates it when stale deadline is reached.
+	 */
+	ct_flags[sock_id] &= ~CT_FLAG_RUN(ct_id);
+}
+
+/* move expired timers of all sockets to timeout state.
+ * nothing is done until the earliest deadline is reached.
+ */
+static void ct_loop(void)
+{
+	uint8_t sock_id, ct_id;
+	uint16_t due_ms16;
+
+	if(!ct_armed || CT_BEFORE(ct_now_ms16, ct_next_ms16))
+		return;
+
+	ct_armed = 0;
+
+	for(sock_id = 0; sock_id < MAX_SOCK_TCP; sock_id++)
 	{
-		case CT_ID_RXLEN:
-			ct_flags[sock_id] &= ~CT_FLAG_RUN_RXLEN;
-			break;
+		if(!(ct_flags[sock_id] & CT_FLAG_RUN_ALL))
+			continue;
 
-		case CT_ID_STATE:
-			ct_flags[sock_id] &= ~CT_FLAG_RUN_STATE;
-			break;
+		for(ct_id = 0; ct_id < CT_ID_COUNT; ct_id++)
+		{
+			if(!(ct_flags[sock_id] & CT_FLAG_RUN(ct_id)))
+				continue;
 
-		case CT_ID_WRITE:
-			ct_flags[sock_id] &= ~CT_FLAG_RUN_WRITE;
-			break;
+			due_ms16 = ct_due_ms16[sock_id][ct_id];
+
+			if(!CT_BEFORE(ct_now_ms16, due_ms16))
+			{
+				ct_flags[sock_id] &= ~CT_FLAG_RUN(ct_id);
+				ct_flags[sock_id] |= CT_FLAG_TO(ct_id);
+			}
+			else
+			{
+				if(!ct_armed || CT_BEFORE(due_ms16, ct_next_ms16))
+				{
+					ct_next_ms16 = due_ms16;
+					ct_armed = 1;
+				}
+			}
+		}
 	}
 }
 
-static void ct_loop(uint8_t sock_id)
+/* write data to shield data buffer & send it.
+ * - wbuf may be in PROGMEM (pgm = true), data is streamed to SPI without RAM copy
+ * - data longer than NC_SPI_CHUNK_SIZE is split to fit SPI length field
+ */
+static void nc_send(uint8_t sock_id, const uint8_t *wbuf, size_t wlen, boolean pgm)
 {
-	if(ct_flags[sock_id] & CT_FLAG_RUN_RXLEN)
+	int len;
+
+	while(wlen)
 	{
-		if(ct_elapsed_ms(ct_t1_rxlen[sock_id]) >= CTO_RXLEN)
+		if(wlen > NC_SPI_CHUNK_SIZE)
+			len = NC_SPI_CHUNK_SIZE;
+		else
+			len = wlen;
+
+#ifdef INCLUDE_LIB_V1
+		if(Sppc.flags & PF_SYNC_V1)
+		{
+			Phpoc.command(F("tcp%u send"), sock_id);
+			if(!Sppc.errno)
+			{
+				if(pgm)
+					Phpoc.write_P(wbuf, len);
+				else
+					Phpoc.write(wbuf, len);
+			}
+		}
+		else
+#endif
 		{
-			ct_flags[sock_id] &= ~CT_FLAG_RUN_RXLEN;
-			ct_flags[sock_id] |= CT_FLAG_TO_RXLEN;
+			if(pgm)
+				Phpoc.write_P(wbuf, len);
+			else
+				Phpoc.write(wbuf, len);
+
+			if(!Sppc.errno)
+				Phpoc.command(F("tcp%u send"), sock_id);
 		}
+
+		if(Sppc.errno)
+			break;
+
+		/* consume cached transmit credit */
+		if(nc_tcp_txfree[sock_id] > len)
+			nc_tcp_txfree[sock_id] -= len;
+		else
+			nc_tcp_txfree[sock_id] = 0;
+
+		wbuf += len;
+		wlen -= len;
 	}
+}
 
-	if(ct_flags[sock_id] & CT_FLAG_RUN_STATE)
+/* cached txfree is renewed when CTO_TXFREE is expired, or on request */
+static int nc_txfree(uint8_t sock_id, uint8_t renew)
+{
+	if(renew || (ct_flags[sock_id] & CT_FLAG_TO_TXFREE))
 	{
-		if(ct_elapsed_ms(ct_t1_state[sock_id]) >= CTO_STATE)
-		{
-			ct_flags[sock_id] &= ~CT_FLAG_RUN_STATE;
-			ct_flags[sock_id] |= CT_FLAG_TO_STATE;
-		}
+		ct_flags[sock_id] &= ~CT_FLAG_TO_TXFREE;
+
+		nc_tcp_txfree[sock_id] = Phpoc.tcpIoctlReadInt(F("txfree"), sock_id);
+		ct_start(sock_id, CT_ID_TXFREE); /* restart txfree timer */
 	}
 
-	if(ct_flags[sock_id] & CT_FLAG_RUN_WRITE)
+	return nc_tcp_txfree[sock_id];
+}
+
+static void nc_flush_write(uint8_t sock_id);
+static void nc_service(uint8_t sock_id, uint8_t flags);
+
+/* limit write length to transmit credit (txfree - cached write data).
+ * if there is no credit, wait for it as blocking send of shield did.
+ * return 0 on timeout(Phpoc.setTimeout()) or close, Sppc.errno is set.
+ */
+static size_t nc_write_limit(uint8_t sock_id, size_t wlen)
+{
+	unsigned long start_ms;
+	uint8_t wait_ms, state;
+	int space;
+
+#ifdef INCLUDE_LIB_V1
+	/* V1 shield doesn't use txfree(see nc_write_pending), write is not limited */
+	if(Sppc.flags & PF_SYNC_V1)
+		return wlen;
+#endif
+
+	space = nc_txfree(sock_id, 0) - nc_write_len[sock_id];
+
+	if((space > 0) && (wlen <= (size_t)space))
+		return wlen;
+
+	start_ms = millis();
+	wait_ms = 1;
+
+	while(1)
 	{
-		if(ct_elapsed_ms(ct_t1_write[sock_id]) >= CTO_WRITE)
+		/* cached txfree may be too old, check it again before short write */
+		space = nc_txfree(sock_id, 1) - nc_write_len[sock_id];
+
+		/* txfree is unknown, don't drop data on query error */
+		if(Sppc.errno)
+			return wlen;
+
+		if(space > 0)
+			break;
+
+		/* credit is held by write cache, send it & wait until shield drains */
+		if(nc_write_len[sock_id])
+			nc_flush_write(sock_id);
+
+		state = nc_tcp_state[sock_id];
+
+		if((state != TCP_CONNECTED) && (state <= SSL_STOP))
 		{
-			ct_flags[sock_id] &= ~CT_FLAG_RUN_WRITE;
-			ct_flags[sock_id] |= CT_FLAG_TO_WRITE;
+			Sppc.errno = ENOTCONN;
+			return 0;
+		}
+
+		if(Sppc.wait_timeout && ((millis() - start_ms) >= Sppc.wait_timeout))
+		{
+			Sppc.errno = ETIMEDOUT;
+			return 0;
 		}
+
+		delay(wait_ms);
+
+		if((wait_ms <<= 1) > NC_WRITE_WAIT_MS)
+			wait_ms = NC_WRITE_WAIT_MS;
+
+		ct_tick();
+		nc_service(sock_id, NC_FLAG_RENEW_STATE | NC_FLAG_SKIP_REFILL);
 	}
+
+	if(wlen > (size_t)space)
+		wlen = space;
+
+	return wlen;
 }
 
 void nc_init(uint8_t sock_id, int tcp_state)
 {
 	nc_tcp_state[sock_id] = tcp_state;
+	nc_state_mask |= (1 << sock_id);
+	nc_state_seq++;
+	nc_close_mask &= ~(1 << sock_id); /* socket is reused or released */
+
+	ct_tick();
 
 	if((tcp_state == TCP_CLOSED) || (tcp_state == SSL_STOP) || (tcp_state == SSH_STOP))
 	{
-		ct_stop(sock_id, CT_ID_RXLEN);
-		ct_stop(sock_id, CT_ID_STATE);
-		ct_stop(sock_id, CT_ID_WRITE);
+		/* stop all timers & discard pending timeout events,
+		 * closed socket should not be serviced by nc_poll()
+		 */
+		ct_flags[sock_id] = 0;
 	}
 	else
 	{
 		ct_start(sock_id, CT_ID_RXLEN);
 		ct_start(sock_id, CT_ID_STATE);
+		ct_flags[sock_id] |= CT_FLAG_TO_TXFREE; /* txfree is unknown */
 	}
 
 	nc_read_len[sock_id]  = 0;
 	nc_write_len[sock_id] = 0;
 	nc_tcp_rxlen[sock_id] = 0;
+	nc_tcp_txfree[sock_id] = 0;
+	nc_tcp_txbuf[sock_id] = 0;
 }
 
-void nc_update(uint8_t sock_id, uint8_t flags)
+/* read-ahead : refill read cache before it becomes empty.
+ * - cached data is kept at the end of nc_read_buf, new data is appended after it.
+ * - fetch size is limited by free cache space & last known rxlen.
+ */
+static void nc_refill(uint8_t sock_id)
+{
+	uint8_t *cache;
+	int len, read_len;
+
+	read_len = nc_read_len[sock_id];
+
+	if(!nc_tcp_rxlen[sock_id] || (read_len >= SOCK_READ_LOW_WATER))
+		return;
+
+	len = SOCK_READ_CACHE_SIZE - read_len;
+
+	if(len > nc_tcp_rxlen[sock_id])
+		len = nc_tcp_rxlen[sock_id];
+
+	len = Phpoc.command(F("tcp%u recv %u"), sock_id, len);
+
+	if(len > 0)
+	{
+		cache = nc_read_buf[sock_id] + SOCK_READ_CACHE_SIZE;
+
+		if(read_len)
+			memmove(cache - read_len - len, cache - read_len, read_len);
+
+		Phpoc.read(cache - len, len);
+		nc_read_len[sock_id] = read_len + len;
+	}
+
+	if((len > 0) && (nc_tcp_rxlen[sock_id] > len))
+		nc_tcp_rxlen[sock_id] -= len; /* rest of data is still in shield */
+	else
+	{
+		nc_tcp_rxlen[sock_id] = Phpoc.tcpIoctlReadInt(F("rxlen"), sock_id);
+		ct_start(sock_id, CT_ID_RXLEN); /* restart rxlen timer */
+	}
+}
+
+static void nc_flush_write(uint8_t sock_id)
+{
+	ct_flags[sock_id] &= ~CT_FLAG_TO_WRITE;
+
+	if(nc_write_len[sock_id])
+	{
+		nc_send(sock_id, nc_write_buf[sock_id], nc_write_len[sock_id], false);
+		nc_write_len[sock_id] = 0;
+	}
+}
+
+static void nc_close_done(uint8_t sock_id)
+{
+	PhpocClient::conn_flags &= ~(1 << sock_id);
+
+	nc_init(sock_id, TCP_CLOSED);
+}
+
+static void nc_service(uint8_t sock_id, uint8_t flags)
 {
+	uint8_t state;
+
 	if(flags & NC_FLAG_RENEW_RXLEN)
 	{
 		ct_flags[sock_id] &= ~CT_FLAG_RUN_RXLEN;
@@ -188,7 +436,7 @@ void nc_update(uint8_t sock_id, uint8_t flags)
 		ct_flags[sock_id] |= CT_FLAG_TO_WRITE;
 	}
 
-	ct_loop(sock_id); /* update timer event */
+	ct_loop(); /* update timer event */
 
 	if(ct_flags[sock_id] & CT_FLAG_TO_RXLEN)
 	{
@@ -202,50 +450,136 @@ void nc_update(uint8_t sock_id, uint8_t flags)
 	{
 		ct_flags[sock_id] &= ~CT_FLAG_TO_STATE;
 
-		nc_tcp_state[sock_id] = Phpoc.tcpIoctlReadInt(F("state"), sock_id);
+		state = Phpoc.tcpIoctlReadInt(F("state"), sock_id);
+
+		if(nc_tcp_state[sock_id] != state)
+		{
+			nc_tcp_state[sock_id] = state;
+			nc_state_mask |= (1 << sock_id);
+			nc_state_seq++;
+		}
+
+		if((nc_close_mask & (1 << sock_id)) && (nc_tcp_state[sock_id] == TCP_CLOSED))
+		{
+			nc_close_done(sock_id);
+			return;
+		}
+
 		ct_start(sock_id, CT_ID_STATE); /* restart state timer */
 	}
 
 	if(ct_flags[sock_id] & CT_FLAG_TO_WRITE)
+		nc_flush_write(sock_id);
+
+	if(!(flags & NC_FLAG_SKIP_REFILL))
+		nc_refill(sock_id);
+}
+
+/* finish asynchronous close of sockets which are not owned by any client */
+static void nc_close_loop(void)
+{
+	uint8_t sock_id;
+
+	for(sock_id = 0; sock_id < MAX_SOCK_TCP; sock_id++)
 	{
-		ct_flags[sock_id] &= ~CT_FLAG_TO_WRITE;
+		if((nc_close_mask & (1 << sock_id)) && (ct_flags[sock_id] & CT_FLAG_TO_STATE))
+			nc_service(sock_id, 0);
+	}
+}
 
-		if(nc_write_len[sock_id])
-		{
-#ifdef INCLUDE_LIB_V1
-			if(Sppc.flags & PF_SYNC_V1)
-			{
-				Phpoc.command(F("tcp%u send"), sock_id);
-				if(!Sppc.errno)
-					Phpoc.write(nc_write_buf[sock_id], nc_write_len[sock_id]);
-			}
-			else
-#endif
-			{
-				Phpoc.write(nc_write_buf[sock_id], nc_write_len[sock_id]);
-				if(!Sppc.errno)
-					Phpoc.command(F("tcp%u send"), sock_id);
-			}
+/* send expired write cache of all sockets.
+ * start socket rotates, so no socket is always served last.
+ */
+static void nc_flush_loop(void)
+{
+	uint8_t sock_id, count;
 
-			nc_write_len[sock_id] = 0;
-		}
+	sock_id = nc_flush_next;
+
+	for(count = 0; count < MAX_SOCK_TCP; count++)
+	{
+		if(ct_flags[sock_id] & CT_FLAG_TO_WRITE)
+			nc_flush_write(sock_id);
+
+		if(++sock_id == MAX_SOCK_TCP)
+			sock_id = 0;
 	}
 
-	if(!nc_read_len[sock_id] && nc_tcp_rxlen[sock_id])
+	if(++nc_flush_next == MAX_SOCK_TCP)
+		nc_flush_next = 0;
+}
+
+/* timers are serviced by nc_poll() only while sketch keeps calling Phpoc.poll().
+ * ct_tick() should be called before.
+ */
+static uint8_t nc_poll_mode(void)
+{
+	if(nc_polled && ((ct_tick_ms - nc_poll_ms) >= NC_POLL_EXPIRE_MS))
+		nc_polled = 0; /* Phpoc.poll() is not called any more */
+
+	return nc_polled;
+}
+
+void nc_update(uint8_t sock_id, uint8_t flags)
+{
+	ct_tick();
+
+	if(nc_poll_mode() && !(flags & ~NC_FLAG_SKIP_REFILL))
 	{
-		int len;
+		/* status & timers are serviced by nc_poll() */
+		if(!flags)
+			nc_refill(sock_id);
+		return;
+	}
 
-		len = Phpoc.command(F("tcp%u recv %u"), sock_id, SOCK_READ_CACHE_SIZE);
+	nc_service(sock_id, flags);
+	nc_flush_loop();
 
-		if(len > 0)
-		{
-			Phpoc.read(nc_read_buf[sock_id] + SOCK_READ_CACHE_SIZE - len, len);
-			nc_read_len[sock_id] = len;
-		}
+	if(nc_close_mask)
+		nc_close_loop();
+}
 
-		nc_tcp_rxlen[sock_id] = Phpoc.tcpIoctlReadInt(F("rxlen"), sock_id);
+/* service expired timers of sockets in mask.
+ * no command is sent to shield until a timer of the sockets expires.
+ */
+void nc_update_mask(uint8_t mask)
+{
+	uint8_t sock_id;
 
-		ct_start(sock_id, CT_ID_RXLEN); /* restart rxlen timer */
+	ct_tick();
+
+	if(nc_poll_mode())
+		return; /* status & timers are serviced by nc_poll() */
+
+	ct_loop();
+
+	for(sock_id = 0; sock_id < MAX_SOCK_TCP; sock_id++)
+	{
+		/* txfree timeout is consumed by next write, it doesn't need service */
+		if((mask & (1 << sock_id)) && (ct_flags[sock_id] & (CT_FLAG_TO_RXLEN | CT_FLAG_TO_STATE | CT_FLAG_TO_WRITE)))
+			nc_service(sock_id, 0);
+	}
+
+	nc_flush_loop();
+
+	if(nc_close_mask)
+		nc_close_loop();
+}
+
+void nc_poll(void)
+{
+	uint8_t sock_id;
+
+	ct_tick();
+
+	nc_polled = 1;
+	nc_poll_ms = ct_tick_ms;
+
+	for(sock_id = 0; sock_id < MAX_SOCK_TCP; sock_id++)
+	{
+		/* closed socket has no running timer & no pending data */
+		if(ct_flags[sock_id] || nc_write_len[sock_id])
+			nc_service(sock_id, 0);
 	}
 }
 
@@ -264,6 +598,26 @@ int nc_peek(uint8_t sock_id)
 		return EOF;
 }
 
+/* zero copy access to read cache.
+ * cached data is contiguous at the end of nc_read_buf.
+ */
+int nc_peek_buf(uint8_t sock_id, const uint8_t **rbuf)
+{
+	nc_update(sock_id, 0);
+
+	*rbuf = nc_read_buf[sock_id] + SOCK_READ_CACHE_SIZE - nc_read_len[sock_id];
+	return nc_read_len[sock_id];
+}
+
+int nc_consume(uint8_t sock_id, size_t rlen)
+{
+	if(rlen > nc_read_len[sock_id])
+		rlen = nc_read_len[sock_id];
+
+	nc_read_len[sock_id] -= rlen;
+	return rlen;
+}
+
 int nc_read(uint8_t sock_id)
 {
 	nc_update(sock_id, 0);
@@ -282,44 +636,60 @@ int nc_read(uint8_t sock_id)
 
 int nc_read(uint8_t sock_id, uint8_t *rbuf, size_t rlen)
 {
-	int copy_len, recv_len;
+	int copy_len, recv_len, chunk_len, len;
 
-	nc_update(sock_id, 0);
+	/* filling cache is useless if it will be emptied by this read */
+	if(rlen < SOCK_READ_CACHE_SIZE)
+		nc_update(sock_id, 0);
+	else
+		nc_update(sock_id, NC_FLAG_SKIP_REFILL);
 
-	if(nc_read_len[sock_id])
-	{
-		int nc_offset;
+	copy_len = nc_read_len[sock_id];
 
-		if(rlen > nc_read_len[sock_id])
-		{
-			copy_len = nc_read_len[sock_id];
-			recv_len = rlen - nc_read_len[sock_id];
-		}
-		else
-		{
-			copy_len = rlen;
-			recv_len = 0;
-		}
+	if(copy_len > (int)rlen)
+		copy_len = rlen;
 
-		nc_offset = SOCK_READ_CACHE_SIZE - nc_read_len[sock_id];
-		memcpy(rbuf, nc_read_buf[sock_id] + nc_offset, copy_len);
+	if(copy_len)
+	{
+		memcpy(rbuf, nc_read_buf[sock_id] + SOCK_READ_CACHE_SIZE - nc_read_len[sock_id], copy_len);
 		nc_read_len[sock_id] -= copy_len;
 	}
-	else
-		return 0;
 
-	if(!nc_tcp_rxlen[sock_id])
+	recv_len = rlen - copy_len;
+
+	if(!recv_len || !nc_tcp_rxlen[sock_id])
 		return copy_len;
 
-	if(recv_len)
+	/* receive rest of data directly into rbuf, split to fit SPI length field */
+	if(recv_len > nc_tcp_rxlen[sock_id])
+		recv_len = nc_tcp_rxlen[sock_id];
+
+	rbuf += copy_len;
+	len = 0;
+
+	while(recv_len > 0)
 	{
-		recv_len = Phpoc.command(F("tcp%u recv %u"), sock_id, recv_len);
+		chunk_len = (recv_len > NC_SPI_CHUNK_SIZE) ? NC_SPI_CHUNK_SIZE : recv_len;
+		chunk_len = Phpoc.command(F("tcp%u recv %u"), sock_id, chunk_len);
 
-		if(recv_len > 0)
-			Phpoc.read(rbuf + copy_len, recv_len);
+		/* use length actually transferred, not length in command reply */
+		if((chunk_len <= 0) || ((chunk_len = Phpoc.read(rbuf + len, chunk_len)) <= 0))
+			break;
 
-		nc_tcp_rxlen[sock_id] = Phpoc.tcpIoctlReadInt(F("rxlen"), sock_id);
+		len += chunk_len;
+		recv_len -= chunk_len;
 
+		if(chunk_len < NC_SPI_CHUNK_SIZE)
+			break; /* shield has no more data now */
+	}
+
+	recv_len = len;
+
+	if(recv_len && (nc_tcp_rxlen[sock_id] > recv_len))
+		nc_tcp_rxlen[sock_id] -= recv_len; /* rest of data is still in shield */
+	else
+	{
+		nc_tcp_rxlen[sock_id] = Phpoc.tcpIoctlReadInt(F("rxlen"), sock_id);
 		ct_start(sock_id, CT_ID_RXLEN); /* restart rxlen timer */
 	}
 
@@ -476,12 +846,17 @@ int nc_read_line(uint8_t sock_id, uint8_t *rbuf, size_t rlen)
 	return copy_len + recv_len;
 }
 
-int nc_write(uint8_t sock_id, const uint8_t *wbuf, size_t wlen)
+static int nc_write_part(uint8_t sock_id, const uint8_t *wbuf, size_t wlen)
 {
 	int wcnt;
 
+	ct_tick();
+
 	wcnt = 0;
 
+	if(!(wlen = nc_write_limit(sock_id, wlen)))
+		return 0;
+
 	if(nc_write_len[sock_id] + wlen >= SOCK_WRITE_CACHE_SIZE)
 	{
 		if(nc_write_len[sock_id])
@@ -496,40 +871,14 @@ int nc_write(uint8_t sock_id, const uint8_t *wbuf, size_t wlen)
 				wlen -= frag;
 			}
 
-#ifdef INCLUDE_LIB_V1
-			if(Sppc.flags & PF_SYNC_V1)
-			{
-				Phpoc.command(F("tcp%u send"), sock_id);
-				if(!Sppc.errno)
-					Phpoc.write(nc_write_buf[sock_id], SOCK_WRITE_CACHE_SIZE);
-			}
-			else
-#endif
-			{
-				Phpoc.write(nc_write_buf[sock_id], SOCK_WRITE_CACHE_SIZE);
-				if(!Sppc.errno)
-					Phpoc.command(F("tcp%u send"), sock_id);
-			}
+			nc_send(sock_id, nc_write_buf[sock_id], SOCK_WRITE_CACHE_SIZE, false);
 
 			nc_write_len[sock_id] = 0;
 		}
 
 		if(wlen >= SOCK_WRITE_CACHE_SIZE)
 		{
-#ifdef INCLUDE_LIB_V1
-			if(Sppc.flags & PF_SYNC_V1)
-			{
-				Phpoc.command(F("tcp%u send"), sock_id);
-				if(!Sppc.errno)
-					Phpoc.write(wbuf, wlen);
-			}
-			else
-#endif
-			{
-				Phpoc.write(wbuf, wlen);
-				if(!Sppc.errno)
-					Phpoc.command(F("tcp%u send"), sock_id);
-			}
+			nc_send(sock_id, wbuf, wlen, false);
 
 			wcnt += wlen;
 			wlen = 0;
@@ -550,9 +899,181 @@ int nc_write(uint8_t sock_id, const uint8_t *wbuf, size_t wlen)
 		wlen = 0;
 	}
 
-	nc_update(sock_id, 0);
+	if(!nc_poll_mode())
+	{
+		nc_service(sock_id, 0);
+		nc_flush_loop();
+	}
 
 	return wcnt;
 }
 
+static int nc_write_part_P(uint8_t sock_id, const uint8_t *wbuf, size_t wlen)
+{
+	ct_tick();
+
+	if(!(wlen = nc_write_limit(sock_id, wlen)))
+		return 0;
+
+	if(nc_write_len[sock_id] + wlen < SOCK_WRITE_CACHE_SIZE)
+	{
+		/* short string : append to write cache to save "send" command */
+		if(!nc_write_len[sock_id])
+			ct_start(sock_id, CT_ID_WRITE);
+
+		memcpy_P(nc_write_buf[sock_id] + nc_write_len[sock_id], wbuf, wlen);
+		nc_write_len[sock_id] += wlen;
+	}
+	else
+	{
+		/* flush write cache first to keep data order */
+		if(nc_write_len[sock_id])
+		{
+			nc_send(sock_id, nc_write_buf[sock_id], nc_write_len[sock_id], false);
+			nc_write_len[sock_id] = 0;
+		}
+
+		nc_send(sock_id, wbuf, wlen, true);
+
+		ct_stop(sock_id, CT_ID_WRITE);
+	}
+
+	if(!nc_poll_mode())
+	{
+		nc_service(sock_id, 0);
+		nc_flush_loop();
+	}
+
+	return wlen;
+}
+
+/* write all data, waiting transmit credit. return value is shorter than wlen
+ * on timeout or close, Sppc.errno is set.
+ */
+int nc_write(uint8_t sock_id, const uint8_t *wbuf, size_t wlen)
+{
+	int wcnt, len;
+
+	for(wcnt = 0; wcnt < (int)wlen; wcnt += len)
+	{
+		if((len = nc_write_part(sock_id, wbuf + wcnt, wlen - wcnt)) <= 0)
+			break;
+	}
+
+	return wcnt;
+}
+
+int nc_write_P(uint8_t sock_id, const uint8_t *wbuf, size_t wlen)
+{
+	int wcnt, len;
+
+	for(wcnt = 0; wcnt < (int)wlen; wcnt += len)
+	{
+		if((len = nc_write_part_P(sock_id, wbuf + wcnt, wlen - wcnt)) <= 0)
+			break;
+	}
+
+	return wcnt;
+}
+
+int nc_write_space(uint8_t sock_id)
+{
+	int space;
+
+	ct_tick();
+
+	space = nc_txfree(sock_id, 0) - nc_write_len[sock_id];
+
+	if(space > 0)
+		return space;
+	else
+		return 0;
+}
+
+/* send cached write data, and return the number of bytes not sent to peer yet.
+ * - renew 0 : use cached txfree if it's not expired (non-blocking query)
+ * - renew 1 : read txfree from shield
+ */
+int nc_write_pending(uint8_t sock_id, uint8_t renew)
+{
+	uint8_t state;
+	int pending;
+
+	ct_tick();
+
+	/* data of closed or reset socket is never drained */
+	state = nc_tcp_state[sock_id];
+
+	if((state != TCP_CONNECTED) && (state <= SSL_STOP))
+	{
+		Sppc.errno = ENOTCONN;
+		return 0;
+	}
+
+	if(nc_write_len[sock_id])
+	{
+		nc_send(sock_id, nc_write_buf[sock_id], nc_write_len[sock_id], false);
+		nc_write_len[sock_id] = 0;
+		ct_stop(sock_id, CT_ID_WRITE);
+	}
+
+#ifdef INCLUDE_LIB_V1
+	if(Sppc.flags & PF_SYNC_V1)
+		return Phpoc.tcpIoctlReadInt(F("txlen"), sock_id);
+	else
+#endif
+	{
+		/* txbuf size doesn't change while connected */
+		if(!nc_tcp_txbuf[sock_id])
+			nc_tcp_txbuf[sock_id] = Phpoc.tcpIoctlReadInt(F("txbuf"), sock_id);
+
+		pending = nc_tcp_txbuf[sock_id] - nc_txfree(sock_id, renew);
+
+		if(Sppc.errno)
+			return 0; /* txbuf or txfree is unknown */
+
+		if(pending > 0)
+			return pending;
+		else
+			return 0;
+	}
+}
+
+/* close socket without waiting TCP_CLOSED state.
+ * - abort 0 : send cached write data & close. socket is released when
+ *             state timer reads TCP_CLOSED (nc_update/nc_poll)
+ * - abort 1 : discard cached data & release socket now. the socket is closed
+ *             again before next listen/connect (PhpocClient::init_flags)
+ */
+void nc_close(uint8_t sock_id, uint8_t abort)
+{
+	ct_tick();
+
+	if(!abort && nc_write_len[sock_id])
+		nc_send(sock_id, nc_write_buf[sock_id], nc_write_len[sock_id], false);
+
+	Phpoc.command(F("tcp%u ioctl close"), sock_id);
+
+	PhpocClient::conn_flags &= ~(1 << sock_id);
+
+	if(abort)
+	{
+		PhpocClient::init_flags &= ~(1 << sock_id);
+
+		nc_init(sock_id, TCP_CLOSED);
+	}
+	else
+	{
+		nc_close_mask |= (1 << sock_id);
+
+		/* discard data & keep only state timer running */
+		nc_read_len[sock_id]  = 0;
+		nc_write_len[sock_id] = 0;
+		nc_tcp_rxlen[sock_id] = 0;
+
+		ct_flags[sock_id] = 0;
+		ct_start(sock_id, CT_ID_STATE);
+	}
+}
+
 #endif /* INCLUDE_NET_CACHE */
@@ -420,6 +420,16 @@ int PhpocClass::write(const uint8_t *wbuf, size_t wlen)
 		return Sppc.write(wbuf, wlen);
 }
 
+int PhpocClass::write_P(const uint8_t *wbuf, size_t wlen)
+{
+#ifdef INCLUDE_LIB_V1
+	if(Sppc.flags & PF_SYNC_V1)
+		return php_write_data(wbuf, wlen, true);
+	else
+#endif
+		return Sppc.write_P(wbuf, wlen);
+}
+
 int PhpocClass::read(uint8_t *rbuf, size_t rlen)
 {
 	uint16_t status;
@@ -457,9 +467,456 @@ int PhpocClass::read(uint8_t *rbuf, size_t rlen)
 		return Sppc.read(rbuf, rlen);
 }
 
+/* static hosts table in PROGMEM, "address name [name ...]" per line */
+static const char *hosts_table;
+
+/* find address string of hostname in hosts table.
+ * addr_str : 40 bytes buffer (max 39 bytes of IPv6 address)
+ */
+static int hosts_find(const char *hostname, uint8_t type, char *addr_str)
+{
+	const char *ptr;
+	size_t name_len;
+	bool match;
+	int len;
+	char ch;
+
+	if(!hosts_table)
+		return 0;
+
+	name_len = strlen(hostname);
+	ptr = hosts_table;
+
+	while(pgm_read_byte(ptr))
+	{
+		while(((ch = pgm_read_byte(ptr)) == ' ') || (ch == '\t'))
+			ptr++;
+
+		/* address */
+		len = 0;
+		while((ch = pgm_read_byte(ptr)) && !isspace(ch))
+		{
+			if(len < 39)
+				addr_str[len++] = ch;
+			ptr++;
+		}
+		addr_str[len] = 0x00;
+
+		/* names until end of line */
+		match = false;
+		while((ch = pgm_read_byte(ptr)) && (ch != '\n'))
+		{
+			if(isspace(ch))
+			{
+				ptr++;
+				continue;
+			}
+
+			if(!strncasecmp_P(hostname, ptr, name_len))
+			{
+				ch = pgm_read_byte(ptr + name_len);
+				if(!ch || isspace(ch))
+					match = true;
+			}
+
+			while((ch = pgm_read_byte(ptr)) && !isspace(ch))
+				ptr++;
+		}
+
+		if(ch)
+			ptr++; /* '\n' */
+
+		if(!match || !len || (addr_str[0] == '#'))
+			continue;
+
+		if(type == DNS_TYPE_AAAA)
+		{
+			if(strchr(addr_str, ':'))
+				return 1;
+		}
+		else
+		{
+			if(!strchr(addr_str, ':'))
+				return 1;
+		}
+	}
+
+	return 0;
+}
+
+void PhpocClass::setHosts(const __FlashStringHelper *hosts)
+{
+	hosts_table = (const char *)hosts;
+}
+
+#ifdef INCLUDE_DNS_CACHE
+#define DC_FLAG_NEGATIVE 0x80 /* query failed */
+
+#define DC_NEG_WAIT_MS 2000 /* failure of shorter query is not cached */
+
+static uint32_t dc_name_hash[DNS_CACHE_SIZE];  /* FNV-1a hash of host name */
+static uint16_t dc_name_hash2[DNS_CACHE_SIZE]; /* second hash, against collision */
+static uint8_t  dc_name_len[DNS_CACHE_SIZE];
+static uint32_t dc_store_ms[DNS_CACHE_SIZE];
+static uint16_t dc_ttl[DNS_CACHE_SIZE];        /* second unit */
+static uint8_t  dc_type[DNS_CACHE_SIZE]; /* 0 : empty entry */
+static uint8_t  dc_used[DNS_CACHE_SIZE]; /* dc_use_count of last use */
+static uint8_t  dc_addr[DNS_CACHE_SIZE][16];
+static uint8_t  dc_use_count;
+
+/* host name is not stored to save SRAM.
+ * entry is keyed by 32bit FNV-1a hash, 16bit djb2 hash & name length.
+ */
+static void dc_hash(const char *hostname, uint32_t *hash, uint16_t *hash2, uint8_t *len)
+{
+	uint8_t ch;
+
+	*hash = 2166136261UL;
+	*hash2 = 0;
+	*len = 0;
+
+	while(*hostname)
+	{
+		ch = (uint8_t)tolower(*hostname++);
+
+		*hash ^= ch;
+		*hash *= 16777619UL;
+		*hash2 = (uint16_t)(*hash2 * 33U + ch);
+		(*len)++;
+	}
+}
+
+static int dc_lookup(const char *hostname, uint8_t type)
+{
+	uint32_t hash;
+	uint16_t hash2;
+	uint8_t len;
+	int id;
+
+	dc_hash(hostname, &hash, &hash2, &len);
+
+	for(id = 0; id < DNS_CACHE_SIZE; id++)
+	{
+		if(!dc_type[id])
+			continue;
+
+		/* elapsed time is wrap-safe, expired entry is removed on first visit */
+		if((millis() - dc_store_ms[id]) >= (dc_ttl[id] * 1000UL))
+		{
+			dc_type[id] = 0; /* expired */
+			continue;
+		}
+
+		if((dc_name_hash[id] == hash) && (dc_name_hash2[id] == hash2) && (dc_name_len[id] == len) && ((dc_type[id] & ~DC_FLAG_NEGATIVE) == type))
+		{
+			dc_used[id] = ++dc_use_count;
+			return id;
+		}
+	}
+
+	return -1;
+}
+
+static void dc_store(const char *hostname, uint8_t type, const uint8_t *addr, int len, uint16_t ttl)
+{
+	uint32_t hash;
+	uint16_t hash2;
+	uint8_t name_len, age, max_age;
+	int id, victim, slot;
+
+	dc_hash(hostname, &hash, &hash2, &name_len);
+
+	victim = 0;
+	slot = -1; /* entry of same key or first empty entry */
+	max_age = 0;
+
+	/* entry of same name & type, or empty entry, or least recently used entry */
+	for(id = 0; id < DNS_CACHE_SIZE; id++)
+	{
+		if(!dc_type[id])
+		{
+			if(slot < 0)
+				slot = id;
+			continue;
+		}
+
+		if((dc_name_hash[id] == hash) && (dc_name_hash2[id] == hash2) && (dc_name_len[id] == name_len) && ((dc_type[id] & ~DC_FLAG_NEGATIVE) == type))
+		{
+			slot = id; /* overwrite, a name must not be cached twice */
+			break;
+		}
+
+		age = dc_use_count - dc_used[id];
+
+		if(age >= max_age)
+		{
+			max_age = age;
+			victim = id;
+		}
+	}
+
+	if(slot >= 0)
+		victim = slot;
+
+	dc_name_hash[victim] = hash;
+	dc_name_hash2[victim] = hash2;
+	dc_name_len[victim] = name_len;
+	dc_store_ms[victim] = millis();
+	dc_ttl[victim] = ttl;
+	dc_used[victim] = ++dc_use_count;
+
+	if(addr)
+	{
+		dc_type[victim] = type;
+		memcpy(dc_addr[victim], addr, len);
+	}
+	else
+		dc_type[victim] = type | DC_FLAG_NEGATIVE;
+}
+#endif
+
+#ifdef INCLUDE_DNS_CACHE
+/* asynchronous query queue, answers are stored in DNS cache */
+#define DQ_WAIT_MS  2000 /* dns timeout of asynchronous query */
+#define DQ_GUARD_MS 1000 /* extra wait time for answer of shield */
+
+static const char *dq_name[DNS_QUEUE_SIZE];
+static uint8_t  dq_type[DNS_QUEUE_SIZE];
+static uint8_t  dq_count;
+static uint8_t  dq_busy; /* query of dq_name[0] is sent to shield */
+static uint16_t dq_start_ms16;
+
+static int dq_find(const char *hostname, uint8_t type)
+{
+	int id;
+
+	for(id = 0; id < dq_count; id++)
+	{
+		if((dq_type[id] == type) && !strcasecmp(dq_name[id], hostname))
+			return id;
+	}
+
+	return -1;
+}
+
+static void dq_pop(void)
+{
+	dq_count--;
+
+	memmove(dq_name, dq_name + 1, dq_count * sizeof(dq_name[0]));
+	memmove(dq_type, dq_type + 1, dq_count);
+
+	dq_busy = 0;
+}
+
+void PhpocClass::dns_loop()
+{
+	const __FlashStringHelper *type_str;
+	int len;
+
+	if(!dq_count)
+		return;
+
+	if(dq_type[0] == DNS_TYPE_A)
+		type_str = F("A");
+	else
+		type_str = F("AAAA");
+
+	if(!dq_busy)
+	{
+#ifdef PF_LOG_NET
+		if((Sppc.flags & PF_LOG_NET) && Serial)
+			sppc_printf(F("log> dns: async query %S %s\r\n"), type_str, dq_name[0]);
+#endif
+		Sppc.command(F("dns set timeout %d"), DQ_WAIT_MS);
+		Sppc.command(F("dns query %s %S"), dq_name[0], type_str);
+
+		if(Sppc.errno)
+		{
+			dq_pop();
+			return;
+		}
+
+		dq_start_ms16 = (uint16_t)millis();
+		dq_busy = 1;
+		return;
+	}
+
+	/* answer is not ready if command returns EAGAIN */
+	Sppc.flags |= PF_NO_RETRY;
+	len = Sppc.command(F("dns get answer %S"), type_str);
+	Sppc.flags &= ~PF_NO_RETRY;
+
+	if(!len && (Sppc.errno == EAGAIN))
+	{
+		if((uint16_t)((uint16_t)millis() - dq_start_ms16) < (DQ_WAIT_MS + DQ_GUARD_MS))
+			return;
+	}
+
+	if(len > 0)
+	{
+		if(dq_type[0] == DNS_TYPE_A)
+		{
+			IPAddress ipaddr;
+			uint8_t addr[4];
+			int i;
+
+			ipaddr = readIP();
+
+			for(i = 0; i < 4; i++)
+				addr[i] = ipaddr[i];
+
+			dc_store(dq_name[0], DNS_TYPE_A, addr, 4, DNS_CACHE_TTL);
+		}
+		else
+		{
+			IP6Address ip6addr;
+
+			ip6addr = readIP6();
+			dc_store(dq_name[0], DNS_TYPE_AAAA, (uint8_t *)ip6addr.addr_hex16, 16, DNS_CACHE_TTL);
+		}
+	}
+	else
+		dc_store(dq_name[0], dq_type[0], NULL, 0, DNS_NEG_TTL);
+
+#ifdef PF_LOG_NET
+	if((Sppc.flags & PF_LOG_NET) && Serial)
+		sppc_printf(F("log> dns: async answer %S %s %S\r\n"), type_str, dq_name[0], (len > 0) ? F("success") : F("failed"));
+#endif
+
+	dq_pop();
+}
+
+int PhpocClass::resolveAsync(const char *hostname, uint8_t type)
+{
+	if(!(Sppc.flags & PF_SHIELD))
+		return 0;
+
+	if((type != DNS_TYPE_A) && (type != DNS_TYPE_AAAA))
+		return 0;
+
+	if(resolveStatus(hostname, type) >= 0)
+		return 1; /* literal address, cached or already queued */
+
+	if(dc_lookup(hostname, type) >= 0)
+		return 1; /* failed recently, negative cache */
+
+#ifdef INCLUDE_LIB_V1
+	if(Sppc.flags & PF_SYNC_V1)
+	{
+		/* V1 can't poll answer, answer is cached by blocking query */
+		if(type == DNS_TYPE_A)
+		{
+			IPAddress ipaddr;
+			getHostByName(hostname, ipaddr, DQ_WAIT_MS);
+		}
+		else
+		{
+			IP6Address ip6addr;
+			getHostByName6(hostname, ip6addr, DQ_WAIT_MS);
+		}
+		return 1;
+	}
+#endif
+
+	if(dq_count >= DNS_QUEUE_SIZE)
+		return 0;
+
+	dq_name[dq_count] = hostname;
+	dq_type[dq_count] = type;
+	dq_count++;
+
+	dns_loop();
+
+	return 1;
+}
+
+/* remove queries queued with this hostname pointer,
+ * hostname can be released after it. answer of query already sent is ignored.
+ */
+void PhpocClass::resolveCancel(const char *hostname)
+{
+	int id;
+
+	for(id = dq_count - 1; id >= 0; id--)
+	{
+		if(dq_name[id] != hostname)
+			continue;
+
+		if(!id)
+			dq_busy = 0;
+
+		dq_count--;
+
+		memmove(dq_name + id, dq_name + id + 1, (dq_count - id) * sizeof(dq_name[0]));
+		memmove(dq_type + id, dq_type + id + 1, dq_count - id);
+	}
+}
+
+/* return value
+ * -  1 : answer is in cache
+ * -  0 : query is in progress
+ * - -1 : query failed or not requested
+ */
+int PhpocClass::resolveStatus(const char *hostname, uint8_t type)
+{
+	char addr_str[40];
+	int id;
+
+	/* literal address or static hosts table */
+	if(type == DNS_TYPE_A)
+	{
+		IPAddress ipaddr;
+
+		if(ipaddr.fromString(hostname))
+			return 1;
+	}
+	else
+	{
+		IP6Address ip6addr;
+
+		if(ip6addr.fromString(hostname))
+			return 1;
+	}
+
+	if(hosts_find(hostname, type, addr_str))
+		return 1;
+
+	dns_loop();
+
+	if((id = dc_lookup(hostname, type)) >= 0)
+		return (dc_type[id] & DC_FLAG_NEGATIVE) ? -1 : 1;
+
+	if(dq_find(hostname, type) >= 0)
+		return 0;
+
+	return -1;
+}
+#endif
+
+/* blocking answer is limited by "dns set timeout" of shield.
+ * Phpoc.setTimeout() shorter than DNS timeout must not cut it off.
+ */
+static int dns_get_answer(const __FlashStringHelper *type_str)
+{
+	uint16_t wait_timeout;
+	int len;
+
+	wait_timeout = Sppc.wait_timeout;
+	Sppc.wait_timeout = 0;
+	len = Sppc.command(F("dns get answer %S"), type_str);
+	Sppc.wait_timeout = wait_timeout;
+
+	return len;
+}
+
 int PhpocClass::getHostByName(const char *hostname, IPAddress &ipaddr, int wait_ms)
 {
+	char addr_str[40];
 	int len;
+#ifdef INCLUDE_DNS_CACHE
+	int id;
+#endif
 
 	Sppc.errno = 0;
 
@@ -474,6 +931,35 @@ int PhpocClass::getHostByName(const char *hostname, IPAddress &ipaddr, int wait_
 	if(ipaddr.fromString(hostname))
 		return 4;
 
+	if(hosts_find(hostname, DNS_TYPE_A, addr_str) && ipaddr.fromString(addr_str))
+	{
+#ifdef PF_LOG_NET
+		if((Sppc.flags & PF_LOG_NET) && Serial)
+			sppc_printf(F("log> dns: hosts A %s >> %s\r\n"), hostname, addr_str);
+#endif
+		return 4;
+	}
+
+#ifdef INCLUDE_DNS_CACHE
+	if((id = dc_lookup(hostname, DNS_TYPE_A)) >= 0)
+	{
+		if(dc_type[id] & DC_FLAG_NEGATIVE)
+			ipaddr = INADDR_NONE;
+		else
+			ipaddr = IPAddress(dc_addr[id]);
+
+#ifdef PF_LOG_NET
+		if((Sppc.flags & PF_LOG_NET) && Serial)
+		{
+			sppc_printf(F("log> dns: cached A %s >> "), hostname);
+			Serial.print(ipaddr);
+			Serial.println();
+		}
+#endif
+		return 4;
+	}
+#endif
+
 #ifdef PF_LOG_NET
 	if((Sppc.flags & PF_LOG_NET) && Serial)
 		sppc_printf(F("log> dns: query A %s >> "), hostname);
@@ -485,9 +971,12 @@ int PhpocClass::getHostByName(const char *hostname, IPAddress &ipaddr, int wait_
 	else
 #endif
 	{
+#ifdef INCLUDE_DNS_CACHE
+		dq_busy = 0; /* asynchronous query is sent again later */
+#endif
 		Sppc.command(F("dns set timeout %d"), wait_ms);
 		Sppc.command(F("dns query %s A"), hostname);
-		len = Sppc.command(F("dns get answer A"));
+		len = dns_get_answer(F("A"));
 	}
 
 	if(len > 0)
@@ -495,6 +984,21 @@ int PhpocClass::getHostByName(const char *hostname, IPAddress &ipaddr, int wait_
 	else
 		ipaddr = INADDR_NONE;
 
+#ifdef INCLUDE_DNS_CACHE
+	if(len > 0)
+	{
+		uint8_t addr[4];
+
+		for(id = 0; id < 4; id++)
+			addr[id] = ipaddr[id];
+
+		dc_store(hostname, DNS_TYPE_A, addr, 4, DNS_CACHE_TTL);
+	}
+	else
+	if((wait_ms >= DC_NEG_WAIT_MS) && (Sppc.errno != ETIMEDOUT))
+		dc_store(hostname, DNS_TYPE_A, NULL, 0, DNS_NEG_TTL);
+#endif
+
 #ifdef PF_LOG_NET
 	if((Sppc.flags & PF_LOG_NET) && Serial)
 	{
@@ -527,7 +1031,11 @@ int PhpocClass::tcpIoctlReadInt(const __FlashStringHelper *args, int sock_id)
 
 int PhpocClass::getHostByName6(const char *hostname, IP6Address &ip6addr, int wait_ms)
 {
+	char addr_str[40];
 	int len;
+#ifdef INCLUDE_DNS_CACHE
+	int id;
+#endif
 
 	Sppc.errno = 0;
 
@@ -539,6 +1047,38 @@ int PhpocClass::getHostByName6(const char *hostname, IP6Address &ip6addr, int wa
 		return 16;
 	}
 
+	if(ip6addr.fromString(hostname))
+		return 16;
+
+	if(hosts_find(hostname, DNS_TYPE_AAAA, addr_str) && ip6addr.fromString(addr_str))
+	{
+#ifdef PF_LOG_NET
+		if((Sppc.flags & PF_LOG_NET) && Serial)
+			sppc_printf(F("log> dns: hosts AAAA %s >> %s\r\n"), hostname, addr_str);
+#endif
+		return 16;
+	}
+
+#ifdef INCLUDE_DNS_CACHE
+	if((id = dc_lookup(hostname, DNS_TYPE_AAAA)) >= 0)
+	{
+		if(dc_type[id] & DC_FLAG_NEGATIVE)
+			ip6addr = IN6ADDR_NONE;
+		else
+			memcpy(ip6addr.addr_hex16, dc_addr[id], 16);
+
+#ifdef PF_LOG_NET
+		if((Sppc.flags & PF_LOG_NET) && Serial)
+		{
+			sppc_printf(F("log> dns: cached AAAA %s >> "), hostname);
+			Serial.print(ip6addr);
+			Serial.println();
+		}
+#endif
+		return 16;
+	}
+#endif
+
 #ifdef PF_LOG_NET
 	if((Sppc.flags & PF_LOG_NET) && Serial)
 		sppc_printf(F("log> dns: query AAAA %s >> "), hostname);
@@ -550,9 +1090,12 @@ int PhpocClass::getHostByName6(const char *hostname, IP6Address &ip6addr, int wa
 	else
 #endif
 	{
+#ifdef INCLUDE_DNS_CACHE
+		dq_busy = 0; /* asynchronous query is sent again later */
+#endif
 		Sppc.command(F("dns set timeout %d"), wait_ms);
 		Sppc.command(F("dns query %s AAAA"), hostname);
-		len = Sppc.command(F("dns get answer AAAA"));
+		len = dns_get_answer(F("AAAA"));
 	}
 
 	if(len > 0)
@@ -560,6 +1103,14 @@ int PhpocClass::getHostByName6(const char *hostname, IP6Address &ip6addr, int wa
 	else
 		ip6addr = IN6ADDR_NONE;
 
+#ifdef INCLUDE_DNS_CACHE
+	if(len > 0)
+		dc_store(hostname, DNS_TYPE_AAAA, (uint8_t *)ip6addr.addr_hex16, 16, DNS_CACHE_TTL);
+	else
+	if((wait_ms >= DC_NEG_WAIT_MS) && (Sppc.errno != ETIMEDOUT))
+		dc_store(hostname, DNS_TYPE_AAAA, NULL, 0, DNS_NEG_TTL);
+#endif
+
 #ifdef PF_LOG_NET
 	if((Sppc.flags & PF_LOG_NET) && Serial)
 	{
@@ -571,6 +1122,24 @@ int PhpocClass::getHostByName6(const char *hostname, IP6Address &ip6addr, int wa
 	return 16;
 }
 
+int PhpocClass::dnsPrefetch(const char *hostname)
+{
+	if(Sppc.flags & PF_IP6)
+	{
+		IP6Address ip6addr;
+
+		getHostByName6(hostname, ip6addr);
+		return ip6addr != IN6ADDR_NONE;
+	}
+	else
+	{
+		IPAddress ipaddr;
+
+		getHostByName(hostname, ipaddr);
+		return ipaddr != INADDR_NONE;
+	}
+}
+
 uint16_t PhpocClass::readInt()
 {
 	char int_str[6]; /* 65535 + NULL(0x00) */
@@ -1015,6 +1584,25 @@ int PhpocClass::maintain()
 	return 0; /* DHCP_CHECK_NONE */
 }
 
+void PhpocClass::poll()
+{
+	if(!(Sppc.flags & PF_SHIELD))
+		return;
+
+#ifdef INCLUDE_NET_CACHE
+	nc_poll();
+#endif
+	PhpocServer::accept_all();
+#ifdef INCLUDE_DNS_CACHE
+	dns_loop();
+#endif
+}
+
+void PhpocClass::setTimeout(uint16_t timeout_ms)
+{
+	Sppc.wait_timeout = timeout_ms;
+}
+
 IPAddress PhpocClass::localIP()
 {
 	Sppc.errno = 0;
@@ -36,10 +36,22 @@
 #include <IP6Address.h>
 
 #define INCLUDE_LIB_V1
+#define INCLUDE_DNS_CACHE
+
+#ifdef INCLUDE_DNS_CACHE
+#define DNS_CACHE_SIZE 4   /* number of cached answers */
+#define DNS_CACHE_TTL  300 /* second unit, shield doesn't report TTL of answer */
+#define DNS_NEG_TTL    30  /* second unit, TTL of failed query */
+#define DNS_QUEUE_SIZE 4   /* number of pending resolveAsync() */
+#endif
+
+#define DNS_TYPE_A    1
+#define DNS_TYPE_AAAA 2
 
 #include <Sppc.h>
 #include <PhpocClient.h>
 #include <PhpocServer.h>
+#include <PhpocPool.h>
 #include <PhpocEmail.h>
 #include <PhpocDateTime.h>
 
@@ -61,11 +73,21 @@ class PhpocClass
 		uint16_t php_request(const char *wbuf, int wlen);
 		int php_write_data(const uint8_t *wbuf, int wlen, boolean pgm);
 #endif
+#ifdef INCLUDE_DNS_CACHE
+		void dns_loop();
+#endif
 
 	public:
 		int tcpIoctlReadInt(const __FlashStringHelper *args, int sock_id);
 		int getHostByName(const char *hostname, IPAddress &ipaddr, int wait_ms = 2000);
 		int getHostByName6(const char *hostname, IP6Address &ip6addr, int wait_ms = 2000);
+		int dnsPrefetch(const char *hostname); /* resolve & cache address of enabled IP version */
+		void setHosts(const __FlashStringHelper *hosts); /* "address name [name ...]" per line */
+#ifdef INCLUDE_DNS_CACHE
+		int resolveAsync(const char *hostname, uint8_t type); /* hostname must be kept until resolved */
+		int resolveStatus(const char *hostname, uint8_t type);
+		void resolveCancel(const char *hostname); /* drop queries queued with this hostname */
+#endif
 		uint16_t readInt(); /* read & parse short integer */
 		IPAddress readIP(); /* read & parse IP address */
 		IP6Address readIP6(); /* read & parse IPv6 address */
@@ -78,11 +100,21 @@ class PhpocClass
 		int write(const __FlashStringHelper *wstr);
 		int write(const char *wstr);
 		int write(const uint8_t *wbuf, size_t wlen);
+		int write_P(const uint8_t *wbuf, size_t wlen); /* wbuf in PROGMEM */
 		int read(uint8_t *rbuf, size_t rlen);
 
 	public:
 		int beginIP4();
 		int beginIP6();
+		/* service all sockets & servers at once.
+		 * while poll() is called every loop(), client/server calls are served
+		 * from net cache without status query. poll mode ends 100ms after last poll().
+		 */
+		void poll();
+		/* default time limit of blocking calls, 0 : no limit(default).
+		 * Sppc.errno is set to ETIMEDOUT on timeout.
+		 */
+		void setTimeout(uint16_t timeout_ms);
 
 	public:
 		/* Arduino Ethernet compatible public member functions */
@@ -31,17 +31,32 @@
 
 #include "Phpoc.h"
 
+#define FLUSH_WAIT_MS 8 /* max. backoff time of flush() */
+#define READ_WAIT_MS 50 /* max. backoff time of read wait, rxlen timer(CTO_RXLEN) of NetCache */
+#define HE_CONN_DELAY_MS 250 /* IPv4 connection attempt delay of dual stack connect */
+
 char PhpocClient::read_line_buf[SOCK_LINE_BUF_SIZE + 2];
 uint8_t PhpocClient::conn_flags;
 uint8_t PhpocClient::init_flags;
+uint16_t PhpocClient::ssl_timeout_ms;
+uint16_t PhpocClient::ssl_start_ms16;
 
 PhpocClient::PhpocClient()
 {
 	sock_id = MAX_SOCK_TCP;
+	opt_txbuf = 0;
+	opt_rxbuf = 0;
+	opt_nodelay = 0;
+	conn_timeout = 0;
 }
 
 PhpocClient::PhpocClient(uint8_t id)
 {
+	opt_txbuf = 0;
+	opt_rxbuf = 0;
+	opt_nodelay = 0;
+	conn_timeout = 0;
+
 	if(id >= MAX_SOCK_TCP)
 		sock_id = MAX_SOCK_TCP;
 	//else
@@ -51,6 +66,30 @@ PhpocClient::PhpocClient(uint8_t id)
 		sock_id = id;
 }
 
+/* set shield buffer size & delayed send option before connect/listen */
+void PhpocClient::sock_opt(uint8_t id, uint16_t txbuf, uint16_t rxbuf, uint8_t nodelay)
+{
+	if(txbuf)
+		Phpoc.command(F("tcp%u ioctl set txbuf %u"), id, txbuf);
+
+	if(rxbuf)
+		Phpoc.command(F("tcp%u ioctl set rxbuf %u"), id, rxbuf);
+
+	if(nodelay)
+		Phpoc.command(F("tcp%u ioctl set nodelay %u"), id, nodelay - 1);
+}
+
+void PhpocClient::setBufferSize(uint16_t txbuf, uint16_t rxbuf)
+{
+	opt_txbuf = txbuf;
+	opt_rxbuf = rxbuf;
+}
+
+void PhpocClient::setNoDelay(bool nodelay)
+{
+	opt_nodelay = nodelay ? 2 : 1;
+}
+
 uint16_t PhpocClient::command(const __FlashStringHelper *format, ...)
 {
 	char vsp_buf[VSP_COUNT_LIMIT];
@@ -87,9 +126,13 @@ uint16_t PhpocClient::command(const char *format, ...)
 	return Sppc.sppc_request(vsp_buf, cmd_len);
 }
 
-int PhpocClient::connectSSL_ipstr(const char *ipstr, uint16_t port)
+int PhpocClient::connectSSL_ipstr_async(const char *ipstr, uint16_t port)
 {
-	uint8_t state;
+	uint8_t state, busy;
+
+	/* same as connect(), socket in use must be stopped first */
+	if(sock_id < MAX_SOCK_TCP)
+		return 0;
 
 	sock_id = SOCK_ID_SSL;
 
@@ -103,19 +146,22 @@ int PhpocClient::connectSSL_ipstr(const char *ipstr, uint16_t port)
 #ifdef INCLUDE_NET_CACHE
 	nc_update(sock_id, NC_FLAG_RENEW_RXLEN | NC_FLAG_RENEW_STATE);
 	state = nc_tcp_state[sock_id];
+	busy = nc_close_mask & (1 << sock_id); /* closing socket keeps last state */
 #else
 	state = Phpoc.tcpIoctlReadInt(F("state"), sock_id);
+	busy = 0;
 #endif
 
 	/* Phpoc/Sppc.command() function returns 0 on error.
 	 * we should check Sppc.errno if state is 0(TCP_CLOSED)
 	 */
-	if((state != TCP_CLOSED) || Sppc.errno || available())
+	if(busy || (state != TCP_CLOSED) || Sppc.errno || available())
 	{
 #ifdef PF_LOG_NET
 		if((Sppc.flags & PF_LOG_NET) && Serial)
 			Serial.println(F("log> phpoc_client: SSL socket not available"));
 #endif
+		sock_id = MAX_SOCK_TCP;
 		return 0;
 	}
 
@@ -136,6 +182,7 @@ _skip_check_sock:
 #endif
 
 	Phpoc.command(F("tcp%u ioctl set api ssl"), sock_id);
+	sock_opt(sock_id, opt_txbuf, opt_rxbuf, opt_nodelay);
 
 #ifdef INCLUDE_LIB_V1
 	if(Sppc.flags & PF_SYNC_V1)
@@ -146,42 +193,17 @@ _skip_check_sock:
 
 	Phpoc.command(F("tcp%u connect %s %u"), sock_id, ipstr, port);
 
-	while(1)
-	{
-		state = Phpoc.tcpIoctlReadInt(F("state"), sock_id);
-
-		if((state == TCP_CLOSED) || (state == SSL_CONNECTED))
-			break;
-
-		delay(10);
-	}
+	ssl_start_ms16 = (uint16_t)millis();
 
-#ifdef PF_LOG_NET
-	if((Sppc.flags & PF_LOG_NET) && Serial)
-	{
-		if(state)
-			Serial.println(F("success"));
-		else
-			Serial.println(F("failed"));
-	}
-#endif
+	return connect_start();
+}
 
-	if(state)
-	{
-#ifdef INCLUDE_NET_CACHE
-		nc_init(sock_id, SSL_CONNECTED);
-#endif
-		conn_flags |= (1 << sock_id);
-		return 1;
-	}
-	else
-	{
-#ifdef INCLUDE_NET_CACHE
-		nc_init(sock_id, TCP_CLOSED);
-#endif
-		sock_id = MAX_SOCK_TCP;
+int PhpocClient::connectSSL_ipstr(const char *ipstr, uint16_t port)
+{
+	if(!connectSSL_ipstr_async(ipstr, port))
 		return 0;
-	}
+
+	return connect_wait();
 }
 
 int PhpocClient::connectSSL(IP6Address ip6addr, uint16_t port)
@@ -199,38 +221,47 @@ int PhpocClient::connectSSL(IPAddress ipaddr, uint16_t port)
 
 int PhpocClient::connectSSL(const char *host, uint16_t port)
 {
-	int len;
+	char ipstr[40]; /* xxxx:......:xxxx (max 39 bytes) */
 
-	if(Sppc.flags & PF_IP6)
-	{
-		IP6Address ip6addr;
+	if(host_to_ipstr(host, ipstr) && connectSSL_ipstr(ipstr, port))
+		return 1;
 
-		Phpoc.getHostByName6(host, ip6addr, 500);
-		if(ip6addr == IN6ADDR_NONE)
-			Phpoc.getHostByName6(host, ip6addr, 2000);
+	/* there is only one SSL socket, fall back to IPv4 after IPv6 failure */
+	if((Sppc.flags & PF_IP6) && (sock_id == MAX_SOCK_TCP) && host_to_ipstr(host, ipstr, DNS_TYPE_A))
+		return connectSSL_ipstr(ipstr, port);
 
-		if(ip6addr != IN6ADDR_NONE)
-			return connectSSL(ip6addr, port);
-		else
-			return 0;
-	}
-	else
-	{
-		IPAddress ipaddr;
+	return 0;
+}
 
-		Phpoc.getHostByName(host, ipaddr, 500);
-		if(ipaddr == INADDR_NONE)
-			Phpoc.getHostByName(host, ipaddr, 2000);
+int PhpocClient::connectSSLAsync(IP6Address ip6addr, uint16_t port)
+{
+	return connectSSL_ipstr_async(ip6addr.toString(), port);
+}
 
-		if(ipaddr != INADDR_NONE)
-			return connectSSL(ipaddr, port);
-		else
-			return 0;
-	}
+int PhpocClient::connectSSLAsync(IPAddress ipaddr, uint16_t port)
+{
+	char ipstr[16]; /* x.x.x.x (7 bytes), xxx.xxx.xxx.xxx (15 bytes) */
 
+	sppc_sprintf(ipstr, F("%u.%u.%u.%u"), ipaddr[0], ipaddr[1], ipaddr[2], ipaddr[3]);
+	return connectSSL_ipstr_async(ipstr, port);
 }
 
-int PhpocClient::connect_ipstr(const char *ipstr, uint16_t port)
+int PhpocClient::connectSSLAsync(const char *host, uint16_t port)
+{
+	char ipstr[40]; /* xxxx:......:xxxx (max 39 bytes) */
+
+	if(!host_to_ipstr(host, ipstr))
+		return 0;
+
+	return connectSSL_ipstr_async(ipstr, port);
+}
+
+void PhpocClient::setHandshakeTimeout(uint16_t timeout_ms)
+{
+	ssl_timeout_ms = timeout_ms;
+}
+
+int PhpocClient::connect_ipstr_async(const char *ipstr, uint16_t port)
 {
 	uint8_t state;
 
@@ -249,6 +280,10 @@ int PhpocClient::connect_ipstr(const char *ipstr, uint16_t port)
 #ifdef INCLUDE_NET_CACHE
 		nc_update(sock_id, NC_FLAG_RENEW_RXLEN | NC_FLAG_RENEW_STATE);
 		state = nc_tcp_state[sock_id];
+
+		/* closing socket keeps last state until it reaches TCP_CLOSED */
+		if(nc_close_mask & (1 << sock_id))
+			continue;
 #else
 		state = Phpoc.tcpIoctlReadInt(F("state"), sock_id);
 #endif
@@ -284,64 +319,155 @@ int PhpocClient::connect_ipstr(const char *ipstr, uint16_t port)
 #endif
 
 	Phpoc.command(F("tcp%u ioctl set api tcp"), sock_id);
+	sock_opt(sock_id, opt_txbuf, opt_rxbuf, opt_nodelay);
 	Phpoc.command(F("tcp%u connect %s %u"), sock_id, ipstr, port);
 
-	while(1)
-	{
-		state = Phpoc.tcpIoctlReadInt(F("state"), sock_id);
+	return connect_start();
+}
 
-		if((state == TCP_CLOSED) || (state == TCP_CONNECTED))
-			break;
+int PhpocClient::connect_ipstr(const char *ipstr, uint16_t port)
+{
+	if(!connect_ipstr_async(ipstr, port))
+		return 0;
 
-		delay(10);
-	}
+	return connect_wait();
+}
 
-#ifdef PF_LOG_NET
-	if((Sppc.flags & PF_LOG_NET) && Serial)
+/* called after "tcpN connect" command is issued */
+int PhpocClient::connect_start()
+{
+#ifdef INCLUDE_NET_CACHE
+	uint8_t state;
+
+	/* shield leaves TCP_CLOSED as soon as "tcpN connect" is accepted */
+	if(!Sppc.errno)
+		state = Phpoc.tcpIoctlReadInt(F("state"), sock_id);
+#endif
+
+	if(Sppc.errno)
 	{
-		if(state)
-			Serial.println(F("success"));
-		else
+#ifdef PF_LOG_NET
+		if((Sppc.flags & PF_LOG_NET) && Serial)
 			Serial.println(F("failed"));
+#endif
+#ifdef INCLUDE_NET_CACHE
+		nc_init(sock_id, TCP_CLOSED);
+#endif
+		sock_id = MAX_SOCK_TCP;
+		return 0;
 	}
+
+#ifdef INCLUDE_NET_CACHE
+	/* state timer of NetCache tracks connection progress */
+	nc_init(sock_id, state);
 #endif
 
-	if(state)
-	{
+	return 1;
+}
+
+/* return value
+ * -  1 : connected
+ * -  0 : connection in progress
+ * - -1 : connection failed, socket is released
+ */
+int PhpocClient::connect_status(uint8_t renew)
+{
+	uint8_t state, conn_state;
+
+	if(sock_id >= MAX_SOCK_TCP)
+		return -1;
+
+	if(conn_flags & (1 << sock_id))
+		return 1;
+
 #ifdef INCLUDE_NET_CACHE
-		nc_init(sock_id, TCP_CONNECTED);
+	if(renew)
+		nc_update(sock_id, NC_FLAG_RENEW_STATE);
+	else
+		nc_update(sock_id, 0);
+
+	state = nc_tcp_state[sock_id];
+#else
+	state = Phpoc.tcpIoctlReadInt(F("state"), sock_id);
 #endif
+
+	if(sock_id == SOCK_ID_SSL)
+		conn_state = SSL_CONNECTED;
+	else
+		conn_state = TCP_CONNECTED;
+
+	if(state == conn_state)
+	{
 		conn_flags |= (1 << sock_id);
 		return 1;
 	}
-	else
+
+	if(state == TCP_CLOSED)
 	{
 #ifdef INCLUDE_NET_CACHE
 		nc_init(sock_id, TCP_CLOSED);
 #endif
 		sock_id = MAX_SOCK_TCP;
-		return 0;
+		return -1;
 	}
-}
 
-int PhpocClient::connect(IP6Address ip6addr, uint16_t port)
-{
-		return connect_ipstr(ip6addr.toString(), port);
+	if((sock_id == SOCK_ID_SSL) && ssl_timeout_ms && ((uint16_t)((uint16_t)millis() - ssl_start_ms16) >= ssl_timeout_ms))
+	{
+#ifdef PF_LOG_NET
+		if((Sppc.flags & PF_LOG_NET) && Serial)
+			Serial.println(F("log> phpoc_client: SSL handshake timeout"));
+#endif
+		stopAsync(true);
+		Sppc.errno = ETIMEDOUT;
+		return -1;
+	}
+
+	return 0;
 }
 
-int PhpocClient::connect(IPAddress ipaddr, uint16_t port)
+int PhpocClient::connect_wait()
 {
-	char ipstr[16]; /* x.x.x.x (7 bytes), xxx.xxx.xxx.xxx (15 bytes) */
+	uint16_t t1_ms16, timeout;
+	int status;
 
-	sppc_sprintf(ipstr, F("%u.%u.%u.%u"), ipaddr[0], ipaddr[1], ipaddr[2], ipaddr[3]);
-	return connect_ipstr(ipstr, port);
+	timeout = conn_timeout ? conn_timeout : Sppc.wait_timeout;
+	t1_ms16 = (uint16_t)millis();
+
+	while(!(status = connect_status(1)))
+	{
+		if(timeout && ((uint16_t)((uint16_t)millis() - t1_ms16) >= timeout))
+		{
+			stopAsync(true);
+			Sppc.errno = ETIMEDOUT;
+			status = -1;
+			break;
+		}
+
+		delay(10);
+	}
+
+#ifdef PF_LOG_NET
+	if((Sppc.flags & PF_LOG_NET) && Serial)
+	{
+		if(status > 0)
+			Serial.println(F("success"));
+		else
+			Serial.println(F("failed"));
+	}
+#endif
+
+	return status > 0;
 }
 
-int PhpocClient::connect(const char *host, uint16_t port)
+/* resolve host name to address string.
+ * type 0 : address type of the enabled IP version
+ */
+int PhpocClient::host_to_ipstr(const char *host, char *ipstr, uint8_t type)
 {
-	int len;
+	if(!type)
+		type = (Sppc.flags & PF_IP6) ? DNS_TYPE_AAAA : DNS_TYPE_A;
 
-	if(Sppc.flags & PF_IP6)
+	if(type == DNS_TYPE_AAAA)
 	{
 		IP6Address ip6addr;
 
@@ -349,10 +475,10 @@ int PhpocClient::connect(const char *host, uint16_t port)
 		if(ip6addr == IN6ADDR_NONE)
 			Phpoc.getHostByName6(host, ip6addr, 2000);
 
-		if(ip6addr != IN6ADDR_NONE)
-			return connect(ip6addr, port);
-		else
+		if(ip6addr == IN6ADDR_NONE)
 			return 0;
+
+		strcpy(ipstr, ip6addr.toString());
 	}
 	else
 	{
@@ -362,60 +488,356 @@ int PhpocClient::connect(const char *host, uint16_t port)
 		if(ipaddr == INADDR_NONE)
 			Phpoc.getHostByName(host, ipaddr, 2000);
 
-		if(ipaddr != INADDR_NONE)
-			return connect(ipaddr, port);
-		else
+		if(ipaddr == INADDR_NONE)
 			return 0;
+
+		sppc_sprintf(ipstr, F("%u.%u.%u.%u"), ipaddr[0], ipaddr[1], ipaddr[2], ipaddr[3]);
 	}
+
+	return 1;
 }
 
-size_t PhpocClient::write(uint8_t byte)
+/* dual stack connect (Happy Eyeballs)
+ * AAAA & A queries are queued together, connection of each family starts as soon as its answer arrives.
+ * IPv4 is tried on another socket HE_CONN_DELAY_MS after IPv6, or right after IPv6 fails.
+ * the first connected socket is used and the other one is aborted.
+ */
+int PhpocClient::connect_dual(const char *host, uint16_t port)
 {
-	if(sock_id >= MAX_SOCK_TCP)
+	char ipstr6[40], ipstr4[16];
+	PhpocClient client4;
+	unsigned long start_ms, start6_ms;
+	uint16_t timeout;
+	int dns6, dns4;       /* 1 : resolved, 0 : in progress, -1 : failed */
+	int status6, status4; /* 1 : connected, 0 : in progress, -1 : failed, -2 : not tried yet */
+
+	if(sock_id < MAX_SOCK_TCP)
 		return 0;
 
-	return write(&byte, 1);
-}
+#ifdef INCLUDE_DNS_CACHE
+	dns6 = Phpoc.resolveAsync(host, DNS_TYPE_AAAA) ? 0 : -2;
+	dns4 = Phpoc.resolveAsync(host, DNS_TYPE_A) ? 0 : -2;
+#else
+	dns6 = -2;
+	dns4 = -2;
+#endif
 
-size_t PhpocClient::write(const uint8_t *buf, size_t size)
-{
-	if(sock_id >= MAX_SOCK_TCP)
-		return 0;
+	/* blocking query if asynchronous query is not available */
+	if(dns6 == -2)
+		dns6 = host_to_ipstr(host, ipstr6, DNS_TYPE_AAAA) ? 1 : -1;
+	if(dns4 == -2)
+		dns4 = host_to_ipstr(host, ipstr4, DNS_TYPE_A) ? 1 : -1;
 
-#ifdef INCLUDE_NET_CACHE
-	return nc_write(sock_id, buf, size);
-#else /* INCLUDE_NET_CACHE */
-#ifdef INCLUDE_LIB_V1
-	if(Sppc.flags & PF_SYNC_V1)
+	client4.setBufferSize(opt_txbuf, opt_rxbuf);
+	client4.opt_nodelay = opt_nodelay;
+	timeout = conn_timeout ? conn_timeout : Sppc.wait_timeout;
+
+	start_ms = millis();
+	start6_ms = start_ms;
+	status6 = -2;
+	status4 = -2;
+
+	while(1)
 	{
-		Phpoc.command(F("tcp%u send"), sock_id);
+#ifdef INCLUDE_DNS_CACHE
+		/* answer is in DNS cache when status is 1, host_to_ipstr() doesn't block */
+		if(!dns6 && (dns6 = Phpoc.resolveStatus(host, DNS_TYPE_AAAA)) > 0)
+			dns6 = host_to_ipstr(host, ipstr6, DNS_TYPE_AAAA) ? 1 : -1;
+		if(!dns4 && (dns4 = Phpoc.resolveStatus(host, DNS_TYPE_A)) > 0)
+			dns4 = host_to_ipstr(host, ipstr4, DNS_TYPE_A) ? 1 : -1;
+#endif
 
-		if(!Sppc.errno)
-			return Phpoc.write(buf, size);
-		else
-			return 0;
+		if((status6 == -2) && dns6)
+		{
+			start6_ms = millis();
+			status6 = ((dns6 > 0) && connect_ipstr_async(ipstr6, port)) ? 0 : -1;
+		}
+
+		if(!status6)
+			status6 = connect_status(1);
+
+		if(status6 > 0)
+		{
+			if(!status4)
+				client4.stopAsync(true);
+			break;
+		}
+
+		if((status4 == -2) && dns4 && ((status6 == -1) || ((millis() - start6_ms) >= HE_CONN_DELAY_MS)))
+			status4 = ((dns4 > 0) && client4.connect_ipstr_async(ipstr4, port)) ? 0 : -1;
+
+		if(!status4)
+			status4 = client4.connect_status(1);
+
+		if(status4 > 0)
+		{
+			if(!status6)
+				stopAsync(true);
+
+			/* take over IPv4 socket */
+			sock_id = client4.sock_id;
+			client4.sock_id = MAX_SOCK_TCP;
+			break;
+		}
+
+		if((status6 == -1) && (status4 == -1))
+			break;
+
+		if(timeout && ((millis() - start_ms) >= timeout))
+		{
+			if(!status6)
+				stopAsync(true);
+			if(!status4)
+				client4.stopAsync(true);
+			Sppc.errno = ETIMEDOUT;
+			break;
+		}
+
+		delay(10);
 	}
-	else
+
+#ifdef INCLUDE_DNS_CACHE
+	Phpoc.resolveCancel(host); /* host may be released after return */
 #endif
-	{
-		Phpoc.write(buf, size);
 
-		if(!Sppc.errno)
-			return Phpoc.command(F("tcp%u send"), sock_id);
+#ifdef PF_LOG_NET
+	if((Sppc.flags & PF_LOG_NET) && Serial)
+	{
+		if(sock_id < MAX_SOCK_TCP)
+			sppc_printf(F("log> phpoc_client: dual stack connect %d success\r\n"), sock_id);
 		else
-			return 0;
+			Serial.println(F("log> phpoc_client: dual stack connect failed"));
 	}
 #endif
+
+	return sock_id < MAX_SOCK_TCP;
 }
 
-int PhpocClient::available()
+int PhpocClient::connect(IP6Address ip6addr, uint16_t port)
 {
-	if(sock_id >= MAX_SOCK_TCP)
-		return 0;
+		return connect_ipstr(ip6addr.toString(), port);
+}
 
-#ifdef INCLUDE_NET_CACHE
-	nc_update(sock_id, 0);
-	return nc_read_len[sock_id] + nc_tcp_rxlen[sock_id];
+int PhpocClient::connect(IPAddress ipaddr, uint16_t port)
+{
+	char ipstr[16]; /* x.x.x.x (7 bytes), xxx.xxx.xxx.xxx (15 bytes) */
+
+	sppc_sprintf(ipstr, F("%u.%u.%u.%u"), ipaddr[0], ipaddr[1], ipaddr[2], ipaddr[3]);
+	return connect_ipstr(ipstr, port);
+}
+
+int PhpocClient::connect(const char *host, uint16_t port)
+{
+	char ipstr[40]; /* xxxx:......:xxxx (max 39 bytes) */
+
+	if(Sppc.flags & PF_IP6)
+		return connect_dual(host, port);
+
+	if(!host_to_ipstr(host, ipstr))
+		return 0;
+
+	return connect_ipstr(ipstr, port);
+}
+
+int PhpocClient::connectAsync(IP6Address ip6addr, uint16_t port)
+{
+	return connect_ipstr_async(ip6addr.toString(), port);
+}
+
+int PhpocClient::connectAsync(IPAddress ipaddr, uint16_t port)
+{
+	char ipstr[16]; /* x.x.x.x (7 bytes), xxx.xxx.xxx.xxx (15 bytes) */
+
+	sppc_sprintf(ipstr, F("%u.%u.%u.%u"), ipaddr[0], ipaddr[1], ipaddr[2], ipaddr[3]);
+	return connect_ipstr_async(ipstr, port);
+}
+
+int PhpocClient::connectAsync(const char *host, uint16_t port)
+{
+	char ipstr[40]; /* xxxx:......:xxxx (max 39 bytes) */
+
+	if(!host_to_ipstr(host, ipstr))
+		return 0;
+
+	return connect_ipstr_async(ipstr, port);
+}
+
+/* poll result of connectAsync(), connection progress is updated by NetCache state timer
+ * -  1 : connected
+ * -  0 : connection in progress
+ * - -1 : connection failed or no connection
+ */
+int PhpocClient::connectStatus()
+{
+	uint8_t id;
+	int status;
+
+	id = sock_id;
+
+	if((id < MAX_SOCK_TCP) && (conn_flags & (1 << id)))
+		return 1;
+
+	status = connect_status(0);
+
+#ifdef PF_LOG_NET
+	if((Sppc.flags & PF_LOG_NET) && Serial)
+	{
+		if(status > 0)
+			sppc_printf(F("log> phpoc_client: connected %d\r\n"), id);
+		else
+		if(status < 0 && (id < MAX_SOCK_TCP))
+			sppc_printf(F("log> phpoc_client: connect failed %d\r\n"), id);
+	}
+#endif
+
+	return status;
+}
+
+/* progress of connectAsync()/connectSSLAsync(), see CONN_XXX */
+int PhpocClient::connectProgress()
+{
+	int status, state;
+
+	if((status = connectStatus()))
+		return (status > 0) ? CONN_ESTABLISHED : CONN_FAILED;
+
+#ifdef INCLUDE_NET_CACHE
+	state = nc_tcp_state[sock_id];
+#else
+	state = Phpoc.tcpIoctlReadInt(F("state"), sock_id);
+#endif
+
+	if(state == TCP_CONNECTED)
+		return CONN_TCP_UP; /* SSL handshake is not started yet */
+
+	if((state > SSL_STOP) && (state < SSL_CONNECTED))
+		return CONN_HANDSHAKING;
+
+	return CONN_CONNECTING;
+}
+
+size_t PhpocClient::write(uint8_t byte)
+{
+	if(sock_id >= MAX_SOCK_TCP)
+		return 0;
+
+#ifdef INCLUDE_NET_CACHE
+	if(nc_write_byte(sock_id, byte) > 0)
+		return 1;
+
+	setWriteError(); /* timeout or closed, see Sppc.errno */
+	return 0;
+#else
+	return write(&byte, 1);
+#endif
+}
+
+size_t PhpocClient::write(const uint8_t *buf, size_t size)
+{
+	if(sock_id >= MAX_SOCK_TCP)
+		return 0;
+
+#ifdef INCLUDE_NET_CACHE
+	int wlen;
+
+	if((wlen = nc_write(sock_id, buf, size)) < (int)size)
+		setWriteError(); /* timeout or closed, see Sppc.errno */
+
+	return wlen;
+#else /* INCLUDE_NET_CACHE */
+#ifdef INCLUDE_LIB_V1
+	if(Sppc.flags & PF_SYNC_V1)
+	{
+		Phpoc.command(F("tcp%u send"), sock_id);
+
+		if(!Sppc.errno)
+			return Phpoc.write(buf, size);
+		else
+			return 0;
+	}
+	else
+#endif
+	{
+		Phpoc.write(buf, size);
+
+		if(!Sppc.errno)
+			return Phpoc.command(F("tcp%u send"), sock_id);
+		else
+			return 0;
+	}
+#endif
+}
+
+size_t PhpocClient::write_P(const uint8_t *buf, size_t size)
+{
+	if(sock_id >= MAX_SOCK_TCP)
+		return 0;
+
+	if(!size)
+		return 0;
+
+#ifdef INCLUDE_NET_CACHE
+	int wlen;
+
+	if((wlen = nc_write_P(sock_id, buf, size)) < (int)size)
+		setWriteError(); /* timeout or closed, see Sppc.errno */
+
+	return wlen;
+#else /* INCLUDE_NET_CACHE */
+#ifdef INCLUDE_LIB_V1
+	if(Sppc.flags & PF_SYNC_V1)
+	{
+		Phpoc.command(F("tcp%u send"), sock_id);
+
+		if(!Sppc.errno)
+			return Phpoc.write_P(buf, size);
+		else
+			return 0;
+	}
+	else
+#endif
+	{
+		Phpoc.write_P(buf, size);
+
+		if(!Sppc.errno)
+			return Phpoc.command(F("tcp%u send"), sock_id);
+		else
+			return 0;
+	}
+#endif
+}
+
+size_t PhpocClient::write(const __FlashStringHelper *fstr)
+{
+	return write_P((const uint8_t *)fstr, strlen_P((const char *)fstr));
+}
+
+/* Print::print(F()) writes flash string byte by byte.
+ * we stream it from PROGMEM to shield directly.
+ */
+size_t PhpocClient::print(const __FlashStringHelper *fstr)
+{
+	return write(fstr);
+}
+
+size_t PhpocClient::println(const __FlashStringHelper *fstr)
+{
+	size_t len;
+
+	len = write(fstr);
+	len += println();
+
+	return len;
+}
+
+int PhpocClient::available()
+{
+	if(sock_id >= MAX_SOCK_TCP)
+		return 0;
+
+#ifdef INCLUDE_NET_CACHE
+	nc_update(sock_id, 0);
+	return nc_read_len[sock_id] + nc_tcp_rxlen[sock_id];
 #else
 	return Phpoc.tcpIoctlReadInt(F("rxlen"), sock_id);
 #endif
@@ -429,7 +851,7 @@ int PhpocClient::read()
 		return EOF;
 
 #ifdef INCLUDE_NET_CACHE
-	return nc_read(sock_id);
+	return nc_read_byte(sock_id);
 #else
 	if(Phpoc.command(F("tcp%u recv 1"), sock_id) > 0)
 	{
@@ -531,7 +953,14 @@ int PhpocClient::readLine(uint8_t *buf, size_t size)
 
 int PhpocClient::availableForWrite(void)
 {
+	if(sock_id >= MAX_SOCK_TCP)
+		return 0;
+
+#ifdef INCLUDE_NET_CACHE
+	return nc_write_space(sock_id);
+#else
 	return Phpoc.tcpIoctlReadInt(F("txfree"), sock_id);
+#endif
 }
 
 int PhpocClient::peek()
@@ -558,61 +987,582 @@ int PhpocClient::peek()
 #endif
 }
 
-void PhpocClient::flush()
+#ifdef INCLUDE_NET_CACHE
+/* wait until read cache has data, Stream timeout is applied.
+ * return length of cached data, 0 on timeout
+ */
+int PhpocClient::read_wait(const uint8_t **buf)
 {
-	if(sock_id >= MAX_SOCK_TCP)
-		return;
+	unsigned long start_ms;
+	uint8_t wait_ms;
+	int len;
 
-#ifdef INCLUDE_NET_CACHE
-	nc_update(sock_id, NC_FLAG_FLUSH_WRITE);
-#endif
+	start_ms = millis();
+	wait_ms = 1;
+
+	while(!(len = nc_peek_buf(sock_id, buf)))
+	{
+		if((millis() - start_ms) >= getTimeout())
+			return 0;
 
+		delay(wait_ms);
+
+		if((wait_ms <<= 1) > READ_WAIT_MS)
+			wait_ms = READ_WAIT_MS;
+
+		nc_update(sock_id, NC_FLAG_RUN_TIMER); /* rxlen is renewed by its timer */
+	}
+
+	return len;
+}
+
+/* get length of data up to terminator (inclusive) in shield */
+int PhpocClient::read_len_until(char terminator)
+{
 #ifdef INCLUDE_LIB_V1
 	if(Sppc.flags & PF_SYNC_V1)
 	{
-		while(Phpoc.tcpIoctlReadInt(F("txlen"), sock_id))
-			delay(10);
+		if((uint8_t)terminator < 0x10)
+			Phpoc.command(F("tcp%u ioctl get rxlen 0%x"), sock_id, (uint8_t)terminator);
+		else
+			Phpoc.command(F("tcp%u ioctl get rxlen %x"), sock_id, (uint8_t)terminator);
+
+		if(!Sppc.errno)
+			return Phpoc.readInt();
+		else
+			return 0;
 	}
+#endif
+
+	/* V2 takes delimiter as it is, printable character or CR/LF(as readLine() sends "\r\n") */
+	if(((terminator > ' ') && (terminator < 0x7f)) || (terminator == '\r') || (terminator == '\n'))
+		return Phpoc.command(F("tcp%u ioctl get rxlen %c"), sock_id, terminator);
 	else
+		return 0;
+}
+
+/* longest prefix of target which is also suffix of (target[0 ~ index-1] + byte) */
+static size_t find_fallback(const char *target, size_t index, char byte)
+{
+	size_t len;
+
+	for(len = index; len > 0; len--)
+	{
+		if(target[len - 1] != byte)
+			continue;
+
+		if(!memcmp(target, target + index + 1 - len, len - 1))
+			return len;
+	}
+
+	return 0;
+}
+#endif
+
+size_t PhpocClient::readBytes(char *buffer, size_t length)
+{
+#ifdef INCLUDE_NET_CACHE
+	const uint8_t *buf;
+	size_t count;
+
+	if(sock_id >= MAX_SOCK_TCP)
+		return 0;
+
+	count = 0;
+
+	/* cached data & rest of data in shield are read at once by nc_read() */
+	while((count < length) && read_wait(&buf))
+		count += nc_read(sock_id, (uint8_t *)buffer + count, length - count);
+
+	return count;
+#else
+	return Stream::readBytes(buffer, length);
 #endif
+}
+
+size_t PhpocClient::readBytesUntil(char terminator, char *buffer, size_t length)
+{
+#ifdef INCLUDE_NET_CACHE
+	const uint8_t *buf, *term;
+	size_t count, len;
+	int line_len;
+
+	if(sock_id >= MAX_SOCK_TCP)
+		return 0;
+
+	count = 0;
+
+	while((count < length) && (len = read_wait(&buf)))
 	{
-		int txfree, txbuf;
+		if(len > (length - count))
+			len = length - count;
 
-		while(1)
+		if((term = (const uint8_t *)memchr(buf, terminator, len)))
 		{
+			len = term - buf;
+			memcpy(buffer + count, buf, len);
+			nc_consume(sock_id, len + 1); /* terminator is discarded */
+			return count + len;
+		}
+
+		memcpy(buffer + count, buf, len);
+		nc_consume(sock_id, len);
+		count += len;
+
+		if((count < length) && nc_tcp_rxlen[sock_id] && (line_len = read_len_until(terminator)))
+		{
+			/* read data before terminator directly, terminator is found in cache on next loop */
+			if(--line_len > (int)(length - count))
+				line_len = length - count;
+
+			if(line_len)
+				count += nc_read(sock_id, (uint8_t *)buffer + count, line_len);
+		}
+	}
+
+	return count;
+#else
+	return Stream::readBytesUntil(terminator, buffer, length);
+#endif
+}
+
+bool PhpocClient::find(char *target, size_t length)
+{
+#ifdef INCLUDE_NET_CACHE
+	const uint8_t *buf;
+	size_t index;
+	int len, i;
+
+	if(!length)
+		return true;
+
+	if(sock_id >= MAX_SOCK_TCP)
+		return false;
+
+	index = 0;
+
+	/* scan read cache in place */
+	while((len = read_wait(&buf)))
+	{
+		for(i = 0; i < len; i++)
+		{
+			if(buf[i] == (uint8_t)target[index])
+				index++;
+			else
+				index = find_fallback(target, index, buf[i]);
+
+			if(index == length)
+			{
+				nc_consume(sock_id, i + 1);
+				return true;
+			}
+		}
+
+		nc_consume(sock_id, len);
+	}
+
+	return false;
+#else
+	return Stream::find(target, length);
+#endif
+}
+
+bool PhpocClient::find(char *target)
+{
+	return find(target, strlen(target));
+}
+
+#ifdef NO_IGNORE_CHAR
+long PhpocClient::parseInt(LookaheadMode lookahead, char ignore)
+#else
+long PhpocClient::parseInt()
+{
+	return parseInt((char)1); /* NO_SKIP_CHAR of Stream */
+}
+
+long PhpocClient::parseInt(char ignore)
+#endif
+{
+#ifdef INCLUDE_NET_CACHE
+	const uint8_t *buf;
+	bool negative, digit;
+	long value;
+	int len, i;
+	uint8_t byte = 0;
+
+	if(sock_id >= MAX_SOCK_TCP)
+		return 0;
+
+	negative = false;
+	digit = false;
+	value = 0;
+
+	/* skip characters before number */
+	while(1)
+	{
+		if(!(len = read_wait(&buf)))
+			return 0;
+
+		for(i = 0; i < len; i++)
+		{
+			byte = buf[i];
+
+			if((byte == '-') || ((byte >= '0') && (byte <= '9')))
+				break;
+#ifdef NO_IGNORE_CHAR
+			if(lookahead == SKIP_NONE)
+				break;
+
+			if((lookahead == SKIP_WHITESPACE) && (byte != ' ') && (byte != '\t') && (byte != '\r') && (byte != '\n'))
+				break;
+#endif
+		}
+
+		nc_consume(sock_id, i);
+
+		if(i < len)
+			break;
+	}
+
+	if((byte != '-') && ((byte < '0') || (byte > '9')))
+		return 0;
+
+	/* read digits */
+	while((len = read_wait(&buf)))
+	{
+		for(i = 0; i < len; i++)
+		{
+			byte = buf[i];
+
+			if(byte == (uint8_t)ignore)
+				continue;
+
+			if(byte == '-')
+			{
+				if(digit || negative)
+					break;
+				negative = true;
+			}
+			else
+			if((byte >= '0') && (byte <= '9'))
+			{
+				value = value * 10 + (byte - '0');
+				digit = true;
+			}
+			else
+				break;
+		}
+
+		nc_consume(sock_id, i);
+
+		if(i < len)
+			break;
+	}
+
+	return negative ? -value : value;
+#else
+#ifdef NO_IGNORE_CHAR
+	return Stream::parseInt(lookahead, ignore);
+#else
+	return Stream::parseInt(ignore);
+#endif
+#endif
+}
+
+/* wait until 'size' bytes are received, rxlen is queried with backoff.
+ * return number of received bytes, less than 'size' on timeout or close.
+ */
+int PhpocClient::waitAvailable(int size, uint16_t timeout)
+{
+	uint16_t t1_ms16;
+	uint8_t wait_ms;
+	int len;
+
+	t1_ms16 = (uint16_t)millis();
+	wait_ms = 1;
+
+	while((len = available()) < size)
+	{
+		if(!connected())
+		{
+			Sppc.errno = ENOTCONN;
+			return available();
+		}
+
+		if(timeout && ((uint16_t)((uint16_t)millis() - t1_ms16) >= timeout))
+		{
+			Sppc.errno = ETIMEDOUT;
+			return len;
+		}
+
+		delay(wait_ms);
+
+		if((wait_ms <<= 1) > READ_WAIT_MS)
+			wait_ms = READ_WAIT_MS;
+
+#ifdef INCLUDE_NET_CACHE
+		nc_update(sock_id, NC_FLAG_RUN_TIMER); /* rxlen is renewed by its timer */
+#endif
+	}
+
+	return len;
+}
+
+/* read 'size' bytes, return number of read bytes, less than 'size' on timeout or close */
+int PhpocClient::readBlocking(uint8_t *buf, size_t size, uint16_t timeout)
+{
+	uint16_t t1_ms16, elapsed;
+	size_t count;
+	int len;
+
+	t1_ms16 = (uint16_t)millis();
+	count = 0;
+
+	while(count < size)
+	{
+		if((len = read(buf + count, size - count)) > 0)
+		{
+			count += len;
+			continue;
+		}
+
+		if(timeout)
+		{
+			elapsed = (uint16_t)millis() - t1_ms16;
+
+			if(elapsed >= timeout)
+			{
+				Sppc.errno = ETIMEDOUT;
+				break;
+			}
+
+			if(!waitAvailable(1, timeout - elapsed))
+				break;
+		}
+		else
+		{
+			if(!waitAvailable(1, 0))
+				break;
+		}
+	}
+
+	return count;
+}
+
+int PhpocClient::peekBuffer(const uint8_t **buf)
+{
+	*buf = NULL;
+
+	if(sock_id >= MAX_SOCK_TCP)
+		return 0;
+
+#ifdef INCLUDE_NET_CACHE
+	return nc_peek_buf(sock_id, buf);
+#else
+	return 0;
+#endif
+}
+
+int PhpocClient::consume(size_t size)
+{
+	if(sock_id >= MAX_SOCK_TCP)
+		return 0;
+
+#ifdef INCLUDE_NET_CACHE
+	return nc_consume(sock_id, size);
+#else
+	return 0;
+#endif
+}
+
+void PhpocClient::flush()
+{
+	flush(Sppc.wait_timeout);
+}
+
+int PhpocClient::flush(uint16_t timeout)
+{
+	uint16_t t1_ms16;
+	uint8_t wait_ms;
+
+	if(sock_id >= MAX_SOCK_TCP)
+		return 1;
+
+	t1_ms16 = (uint16_t)millis();
+	wait_ms = 1;
+
+	while(1)
+	{
+#ifdef INCLUDE_NET_CACHE
+		if(!nc_write_pending(sock_id, 1))
+			return Sppc.errno ? 0 : 1; /* error : socket closed or reset */
+#else /* INCLUDE_NET_CACHE */
+#ifdef INCLUDE_LIB_V1
+		if(Sppc.flags & PF_SYNC_V1)
+		{
+			if(!Phpoc.tcpIoctlReadInt(F("txlen"), sock_id))
+				return 1;
+		}
+		else
+#endif
+		{
+			int txfree, txbuf;
+
 			txfree = Phpoc.tcpIoctlReadInt(F("txfree"), sock_id);
 			txbuf = Phpoc.tcpIoctlReadInt(F("txbuf"), sock_id);
 
+			if(Sppc.errno)
+				return 0;
+
 			if(txfree == txbuf)
-				break;
+				return 1;
+		}
+#endif
 
-			delay(10);
+		if(timeout && ((uint16_t)((uint16_t)millis() - t1_ms16) >= timeout))
+		{
+			Sppc.errno = ETIMEDOUT;
+			return 0;
 		}
+
+		delay(wait_ms);
+
+		if(wait_ms < FLUSH_WAIT_MS)
+			wait_ms <<= 1; /* wait_ms : 1 2 4 8 */
 	}
 }
 
+/* send cached data & return the number of bytes not sent yet (non-blocking) */
+int PhpocClient::flushPending(void)
+{
+	if(sock_id >= MAX_SOCK_TCP)
+		return 0;
+
+#ifdef INCLUDE_NET_CACHE
+	return nc_write_pending(sock_id, 0);
+#else /* INCLUDE_NET_CACHE */
+#ifdef INCLUDE_LIB_V1
+	if(Sppc.flags & PF_SYNC_V1)
+		return Phpoc.tcpIoctlReadInt(F("txlen"), sock_id);
+	else
+#endif
+		return Phpoc.tcpIoctlReadInt(F("txbuf"), sock_id) - Phpoc.tcpIoctlReadInt(F("txfree"), sock_id);
+#endif
+}
+
 void PhpocClient::stop()
 {
+	stop(Sppc.wait_timeout);
+}
+
+/* return value
+ * - 1 : closed
+ * - 0 : close sequence is not finished in time, socket is aborted
+ */
+int PhpocClient::stop(uint16_t timeout)
+{
+	uint16_t t1_ms16;
+	int retval;
+
 	if(sock_id >= MAX_SOCK_TCP)
-		return;
+		return 1;
 
 #ifdef PF_LOG_NET
 	if((Sppc.flags & PF_LOG_NET) && Serial)
 		sppc_printf(F("log> phpoc_client: close %d >> "), sock_id);
 #endif
 
-  Phpoc.command(F("tcp%u ioctl close"), sock_id);
+	t1_ms16 = (uint16_t)millis();
+	retval = 1;
+
+#ifdef INCLUDE_NET_CACHE
+	nc_close(sock_id, 0);
+	nc_update(sock_id, NC_FLAG_RENEW_STATE); /* socket may be closed already */
+
+	while(nc_close_mask & (1 << sock_id))
+	{
+		if(timeout && ((uint16_t)((uint16_t)millis() - t1_ms16) >= timeout))
+		{
+			nc_close(sock_id, 1);
+			retval = 0;
+			break;
+		}
+
+		delay(10);
+		nc_update(sock_id, NC_FLAG_RENEW_STATE);
+	}
+#else
+	Phpoc.command(F("tcp%u ioctl close"), sock_id);
 
 	while(Phpoc.tcpIoctlReadInt(F("state"), sock_id) != TCP_CLOSED)
+	{
+		if(timeout && ((uint16_t)((uint16_t)millis() - t1_ms16) >= timeout))
+		{
+			init_flags &= ~(1 << sock_id); /* closed again before next use */
+			retval = 0;
+			break;
+		}
+
 		delay(10);
+	}
+#endif
+
+#ifdef PF_LOG_NET
+	if((Sppc.flags & PF_LOG_NET) && Serial)
+	{
+		if(retval)
+			Serial.println(F("closed"));
+		else
+			Serial.println(F("timeout"));
+	}
+#endif
+
+	conn_flags &= ~(1 << sock_id);
+
+	sock_id = MAX_SOCK_TCP;
+
+	if(!retval)
+		Sppc.errno = ETIMEDOUT;
+
+	return retval;
+}
+
+void PhpocClient::setConnectionTimeout(uint16_t timeout_ms)
+{
+	conn_timeout = timeout_ms;
+}
+
+/* close socket & return immediately.
+ * - socket is released by NetCache when it reaches TCP_CLOSED state
+ * - abort : don't wait close sequence, socket can be reused right now
+ */
+void PhpocClient::stopAsync(bool abort)
+{
+	if(sock_id >= MAX_SOCK_TCP)
+		return;
+
+#ifdef PF_LOG_NET
+	if((Sppc.flags & PF_LOG_NET) && Serial)
+		sppc_printf(F("log> phpoc_client: close %d >> "), sock_id);
+#endif
 
 #ifdef INCLUDE_NET_CACHE
-	nc_init(sock_id, TCP_CLOSED);
+	nc_close(sock_id, abort);
+#else
+	Phpoc.command(F("tcp%u ioctl close"), sock_id);
+
+	if(abort)
+		init_flags &= ~(1 << sock_id);
 #endif
 
 #ifdef PF_LOG_NET
 	if((Sppc.flags & PF_LOG_NET) && Serial)
-		Serial.println(F("closed"));
+	{
+		if(abort)
+			Serial.println(F("aborted"));
+		else
+			Serial.println(F("closing"));
+	}
 #endif
 
 	conn_flags &= ~(1 << sock_id);
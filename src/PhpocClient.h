@@ -43,11 +43,19 @@
 
 #ifdef INCLUDE_NET_CACHE
 #define SOCK_READ_CACHE_SIZE 18  /* 3x 6bytes websocket data */
+#define SOCK_READ_LOW_WATER   6  /* read-ahead if cached data is less than this */
 #define SOCK_WRITE_CACHE_SIZE 16
 #endif
 
 #define SOCK_LINE_BUF_SIZE 32
 
+/* return value of connectProgress() */
+#define CONN_FAILED      -1
+#define CONN_CONNECTING   0 /* TCP connection in progress */
+#define CONN_TCP_UP       1 /* TCP connected, SSL handshake not started */
+#define CONN_HANDSHAKING  2 /* SSL handshake in progress */
+#define CONN_ESTABLISHED  3
+
 class PhpocClient : public Client
 {
 	private:
@@ -55,9 +63,27 @@ class PhpocClient : public Client
 
 	private:
 		uint8_t sock_id;
+		uint16_t opt_txbuf; /* 0 : default size of shield */
+		uint16_t opt_rxbuf;
+		uint8_t opt_nodelay; /* 0 : default, 1 : delayed send(Nagle), 2 : no delay */
+		uint16_t conn_timeout; /* 0 : Sppc.wait_timeout */
+		static void sock_opt(uint8_t id, uint16_t txbuf, uint16_t rxbuf, uint8_t nodelay);
 		int read_line_from_cache(uint8_t *buf, size_t size);
+		int connectSSL_ipstr_async(const char *ipstr, uint16_t port);
 		int connectSSL_ipstr(const char *ipstr, uint16_t port);
+		int connect_ipstr_async(const char *ipstr, uint16_t port);
 		int connect_ipstr(const char *ipstr, uint16_t port);
+		int connect_start();
+		int connect_status(uint8_t renew);
+		int connect_wait();
+		int host_to_ipstr(const char *host, char *ipstr, uint8_t type = 0);
+		int connect_dual(const char *host, uint16_t port);
+		int read_wait(const uint8_t **buf);
+		int read_len_until(char terminator);
+
+	private:
+		static uint16_t ssl_timeout_ms; /* SSL handshake deadline, 0 : no deadline */
+		static uint16_t ssl_start_ms16;
 
 	public:
 		static uint8_t conn_flags;
@@ -69,9 +95,50 @@ class PhpocClient : public Client
 		int connectSSL(IP6Address ip6addr, uint16_t port);
 		int connectSSL(IPAddress ipaddr, uint16_t port);
 		int connectSSL(const char *host, uint16_t port);
+		int connectAsync(IP6Address ip6addr, uint16_t port);
+		int connectAsync(IPAddress ipaddr, uint16_t port);
+		int connectAsync(const char *host, uint16_t port);
+		int connectStatus();
+		int connectSSLAsync(IP6Address ip6addr, uint16_t port);
+		int connectSSLAsync(IPAddress ipaddr, uint16_t port);
+		int connectSSLAsync(const char *host, uint16_t port);
+		int connectProgress();
+		static void setHandshakeTimeout(uint16_t timeout_ms); /* 0 : no deadline */
+		void setBufferSize(uint16_t txbuf, uint16_t rxbuf); /* applied on next connect, 0 : default */
+		void setNoDelay(bool nodelay); /* applied on next connect */
 		char *readLine(void);
 		int readLine(uint8_t *buf, size_t size);
+		int waitAvailable(int size, uint16_t timeout); /* timeout 0 : no limit */
+		int readBlocking(uint8_t *buf, size_t size, uint16_t timeout); /* timeout 0 : no limit */
+		int peekBuffer(const uint8_t **buf); /* *buf is valid until next call of client */
+		int consume(size_t size);
 		int availableForWrite(void);
+		int flush(uint16_t timeout); /* timeout 0 : wait until tx data is drained */
+		int flushPending(void);
+		void stopAsync(bool abort = false);
+		int stop(uint16_t timeout); /* timeout 0 : wait until closed */
+		void setConnectionTimeout(uint16_t timeout_ms); /* 0 : Phpoc.setTimeout() value */
+		size_t write_P(const uint8_t *buf, size_t size); /* buf in PROGMEM */
+		size_t write(const __FlashStringHelper *fstr);
+		size_t print(const __FlashStringHelper *fstr);
+		size_t println(const __FlashStringHelper *fstr);
+
+		/* Stream functions scanning read cache in place */
+		size_t readBytes(char *buffer, size_t length);
+		size_t readBytes(uint8_t *buffer, size_t length) { return readBytes((char *)buffer, length); }
+		size_t readBytesUntil(char terminator, char *buffer, size_t length);
+		size_t readBytesUntil(char terminator, uint8_t *buffer, size_t length) { return readBytesUntil(terminator, (char *)buffer, length); }
+		bool find(char *target);
+		bool find(uint8_t *target) { return find((char *)target); }
+		bool find(char *target, size_t length);
+		bool find(uint8_t *target, size_t length) { return find((char *)target, length); }
+		bool find(char target) { return find(&target, 1); }
+#ifdef NO_IGNORE_CHAR
+		long parseInt(LookaheadMode lookahead = SKIP_ALL, char ignore = NO_IGNORE_CHAR);
+#else
+		long parseInt();
+		long parseInt(char ignore);
+#endif
 
 	public:
 		/* Arduino EthernetClient compatible public member functions */
@@ -96,27 +163,81 @@ class PhpocClient : public Client
 		virtual bool operator!=(const PhpocClient& rhs) { return !this->operator==(rhs); };
 
 		using Print::write;
+		using Print::print;
+		using Print::println;
+
+		friend class PhpocPool;
+		friend class PhpocServer;
 };
 
 #define NC_FLAG_RENEW_RXLEN 0x01
 #define NC_FLAG_RENEW_STATE 0x02
 #define NC_FLAG_FLUSH_WRITE 0x04
+#define NC_FLAG_RUN_TIMER   0x08 /* service expired timers even if Phpoc.poll() is used */
 
 #ifdef INCLUDE_NET_CACHE
 /* NetCache.cpp */
 extern uint8_t  nc_tcp_state[MAX_SOCK_TCP];
 extern uint16_t nc_tcp_rxlen[MAX_SOCK_TCP];
+extern uint16_t nc_tcp_txfree[MAX_SOCK_TCP];
+extern uint8_t  nc_close_mask;
+extern uint8_t  nc_state_mask;
+extern uint8_t  nc_state_seq;
 extern uint8_t  nc_read_len[MAX_SOCK_TCP];
 extern uint8_t  nc_write_len[MAX_SOCK_TCP];
 extern uint8_t  nc_read_buf[MAX_SOCK_TCP][SOCK_READ_CACHE_SIZE];
 extern uint8_t  nc_write_buf[MAX_SOCK_TCP][SOCK_WRITE_CACHE_SIZE];
 extern void nc_init(uint8_t id, int tcp_state);
 extern void nc_update(uint8_t id, uint8_t flags);
+extern void nc_update_mask(uint8_t mask);
+extern void nc_poll(void);
 extern int  nc_peek(uint8_t id);
+extern int  nc_peek_buf(uint8_t id, const uint8_t **rbuf);
+extern int  nc_consume(uint8_t id, size_t rlen);
 extern int  nc_read(uint8_t id);
 extern int  nc_read(uint8_t id, uint8_t *rbuf, size_t rlen);
 extern int  nc_read_line(uint8_t id, uint8_t *rbuf, size_t rlen);
 extern int  nc_write(uint8_t id, const uint8_t *wbuf, size_t wlen);
+extern int  nc_write_P(uint8_t id, const uint8_t *wbuf, size_t wlen);
+extern int  nc_write_space(uint8_t id);
+extern int  nc_write_pending(uint8_t id, uint8_t renew);
+extern void nc_close(uint8_t id, uint8_t abort);
+
+/* single byte fast path : read from / append to cache without timer service.
+ * slow path (nc_read/nc_write) runs at cache boundary,
+ * so timers are serviced at least once per cache size bytes.
+ */
+static inline int nc_read_byte(uint8_t id)
+{
+	uint8_t len;
+
+	len = nc_read_len[id];
+
+	if(len > SOCK_READ_LOW_WATER)
+	{
+		nc_read_len[id] = len - 1;
+		return nc_read_buf[id][SOCK_READ_CACHE_SIZE - len];
+	}
+
+	return nc_read(id);
+}
+
+static inline int nc_write_byte(uint8_t id, uint8_t byte)
+{
+	uint8_t len;
+
+	len = nc_write_len[id];
+
+	/* empty cache : write timer must be started by nc_write() */
+	if(len && (len < (SOCK_WRITE_CACHE_SIZE - 1)) && (len < nc_tcp_txfree[id]))
+	{
+		nc_write_buf[id][len] = byte;
+		nc_write_len[id] = len + 1;
+		return 1;
+	}
+
+	return nc_write(id, &byte, 1);
+}
 #endif
 
 #endif
@@ -270,6 +270,12 @@ size_t PhpocEmail::write(const uint8_t *wbuf, size_t wlen)
 
 uint8_t PhpocEmail::send()
 {
+	return send(Sppc.wait_timeout);
+}
+
+uint8_t PhpocEmail::send(uint16_t timeout)
+{
+	uint16_t t1_ms16;
 	int len, status;
 
 #ifdef PF_LOG_APP
@@ -290,6 +296,8 @@ uint8_t PhpocEmail::send()
 	else
 		Phpoc.command(F("php smtp send"));
 
+	t1_ms16 = (uint16_t)millis();
+
 	while(1)
 	{
 #ifdef PF_LOG_APP
@@ -323,6 +331,12 @@ uint8_t PhpocEmail::send()
 				break;
 		}
 
+		if(timeout && ((uint16_t)((uint16_t)millis() - t1_ms16) >= timeout))
+		{
+			Sppc.errno = ETIMEDOUT;
+			return 0;
+		}
+
 		delay(10);
 	}
 
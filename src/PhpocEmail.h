@@ -56,6 +56,7 @@ class PhpocEmail : public Print
 		virtual size_t write(uint8_t byte);
 		virtual size_t write(const uint8_t *wbuf, size_t wlen);
 		uint8_t send();
+		uint8_t send(uint16_t timeout); /* timeout 0 : wait until mail server responds */
 		using Print::write;
 };
 
@@ -0,0 +1,227 @@
+/*
+ * Copyright (c) 2016, Sollae Systems. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * - Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * - Neither the name of the Sollae Systems nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY SOLLAE SYSTEMS "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL SOLLAE SYSTEMS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <Phpoc.h>
+
+PhpocPool::PhpocPool()
+{
+	int id;
+
+	for(id = 0; id < POOL_SIZE; id++)
+	{
+		pool_host[id] = NULL;
+		pool_flags[id] = 0;
+	}
+}
+
+int PhpocPool::find(const char *host, uint16_t port, uint8_t flags)
+{
+	int id;
+
+	for(id = 0; id < POOL_SIZE; id++)
+	{
+		if(!pool_host[id] || (pool_flags[id] & POOL_FLAG_USED))
+			continue;
+
+		if((pool_port[id] == port) && ((pool_flags[id] & POOL_FLAG_SSL) == flags) && !strcasecmp(pool_host[id], host))
+			return id;
+	}
+
+	return -1;
+}
+
+/* start background connection of idle entry */
+int PhpocPool::reconnect(int id)
+{
+	int retval;
+
+	pool_client[id].stopAsync(true);
+
+	if(pool_flags[id] & POOL_FLAG_SSL)
+		retval = pool_client[id].connectSSLAsync(pool_host[id], pool_port[id]);
+	else
+		retval = pool_client[id].connectAsync(pool_host[id], pool_port[id]);
+
+	if(retval)
+		pool_flags[id] |= POOL_FLAG_PENDING;
+	else
+		pool_flags[id] &= ~POOL_FLAG_PENDING;
+
+	return retval;
+}
+
+PhpocClient PhpocPool::get(const char *host, uint16_t port, bool ssl)
+{
+	uint8_t flags;
+	int id;
+
+	flags = ssl ? POOL_FLAG_SSL : 0;
+
+	if((id = find(host, port, flags)) < 0)
+	{
+		/* free entry, handed out entry closed by client.stop() or idle entry */
+		for(id = 0; id < POOL_SIZE; id++)
+		{
+			if(!pool_host[id])
+				break;
+
+			if((pool_flags[id] & POOL_FLAG_USED) && !(PhpocClient::conn_flags & (1 << pool_client[id].sock_id)))
+			{
+				/* socket is already closed & may be used by other client */
+				pool_client[id] = PhpocClient();
+				break;
+			}
+		}
+
+		if(id == POOL_SIZE)
+		{
+			for(id = 0; id < POOL_SIZE; id++)
+			{
+				if(!(pool_flags[id] & POOL_FLAG_USED))
+					break;
+			}
+		}
+
+		if(id == POOL_SIZE)
+			return PhpocClient(); /* all connections are in use */
+
+		pool_host[id] = host;
+		pool_port[id] = port;
+		pool_flags[id] = flags;
+
+		if(!reconnect(id))
+		{
+			pool_host[id] = NULL;
+			return PhpocClient(); /* no socket or host not resolved */
+		}
+	}
+	else
+	if(!(pool_flags[id] & POOL_FLAG_PENDING) && !pool_client[id].connected())
+	{
+		/* closed by peer while idle */
+		if(!reconnect(id))
+		{
+			pool_host[id] = NULL;
+			return PhpocClient();
+		}
+	}
+
+	if(pool_flags[id] & POOL_FLAG_PENDING)
+	{
+		pool_flags[id] &= ~POOL_FLAG_PENDING;
+
+		/* state is renewed in every step, Phpoc.poll() is not needed */
+		if(!pool_client[id].connect_wait())
+		{
+			pool_host[id] = NULL;
+			return PhpocClient();
+		}
+	}
+
+	pool_flags[id] |= POOL_FLAG_USED;
+
+	return pool_client[id];
+}
+
+void PhpocPool::release(PhpocClient &client)
+{
+	int id;
+
+	for(id = 0; id < POOL_SIZE; id++)
+	{
+		if(pool_host[id] && (pool_flags[id] & POOL_FLAG_USED) && (pool_client[id] == client))
+		{
+			pool_flags[id] &= ~POOL_FLAG_USED;
+
+			/* unread response would be received by next get() user, drop the connection */
+			if(client.available())
+			{
+				pool_client[id].stopAsync();
+				pool_host[id] = NULL;
+				pool_flags[id] = 0;
+			}
+			break;
+		}
+	}
+
+	if(id == POOL_SIZE)
+		client.stop(); /* not a pooled connection */
+	else
+		client = PhpocClient();
+}
+
+/* check idle connections & reconnect closed ones in background.
+ * state is read from NetCache, it should be called in every loop().
+ */
+void PhpocPool::loop()
+{
+	int id, status;
+
+	for(id = 0; id < POOL_SIZE; id++)
+	{
+		if(!pool_host[id] || (pool_flags[id] & POOL_FLAG_USED))
+			continue;
+
+		if(pool_flags[id] & POOL_FLAG_PENDING)
+		{
+			if((status = pool_client[id].connectStatus()))
+			{
+				pool_flags[id] &= ~POOL_FLAG_PENDING;
+
+				if(status < 0)
+					pool_host[id] = NULL; /* don't retry unreachable host every loop */
+			}
+		}
+		else
+		if(!pool_client[id].connected())
+		{
+			if(!reconnect(id))
+				pool_host[id] = NULL; /* don't retry unreachable host every loop */
+		}
+	}
+}
+
+void PhpocPool::clear()
+{
+	int id;
+
+	for(id = 0; id < POOL_SIZE; id++)
+	{
+		if(!pool_host[id])
+			continue;
+
+		if(!(pool_flags[id] & POOL_FLAG_USED))
+			pool_client[id].stop();
+
+		pool_host[id] = NULL;
+		pool_flags[id] = 0;
+	}
+}
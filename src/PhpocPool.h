@@ -0,0 +1,62 @@
+/*
+ * Copyright (c) 2016, Sollae Systems. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * - Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * - Neither the name of the Sollae Systems nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY SOLLAE SYSTEMS "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL SOLLAE SYSTEMS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef PhpocPool_h
+#define PhpocPool_h
+
+#define POOL_SIZE 2 /* max. number of pooled connections */
+
+#define POOL_FLAG_SSL     0x01
+#define POOL_FLAG_USED    0x02 /* handed out by get() */
+#define POOL_FLAG_PENDING 0x04 /* background reconnect in progress */
+
+/* keeps idle connections open & hands out connected client.
+ * host string must be kept while it is in pool.
+ */
+class PhpocPool
+{
+	private:
+		const char *pool_host[POOL_SIZE];
+		uint16_t pool_port[POOL_SIZE];
+		uint8_t pool_flags[POOL_SIZE];
+		PhpocClient pool_client[POOL_SIZE];
+		int find(const char *host, uint16_t port, uint8_t flags);
+		int reconnect(int id);
+
+	public:
+		PhpocPool();
+		PhpocClient get(const char *host, uint16_t port, bool ssl = false);
+		void release(PhpocClient &client); /* use instead of client.stop() */
+		void loop();
+		void clear();
+};
+
+#endif
@@ -31,16 +31,68 @@
 
 #include <Phpoc.h>
 
-uint16_t PhpocServer::server_port[MAX_SOCK_TCP];
-const char *PhpocServer::server_ws_path[MAX_SOCK_TCP];
+PhpocServer *PhpocServer::server_list[MAX_SOCK_TCP - SOCK_ID_TCP];
+
+static uint8_t mask_count(uint8_t mask)
+{
+	uint8_t count;
+
+	for(count = 0; mask; count++)
+		mask &= mask - 1; /* clear lowest bit */
+
+	return count;
+}
 
 PhpocServer::PhpocServer(uint16_t port)
 {
 	listen_port = port;
+	listen_backlog = 1;
 	server_api = SERVER_API_TCP;
+	opt_txbuf = 0;
+	opt_rxbuf = 0;
+	opt_nodelay = 0;
+	sock_mask = 0;
+	listen_mask = 0;
+	close_mask = 0;
+	next_sock_id = SOCK_ID_TCP;
+	listen_wait = 0;
+}
+
+/* unregister server, Phpoc.poll() must not call a destroyed object */
+PhpocServer::~PhpocServer()
+{
+	uint8_t id;
+
+	for(id = 0; id < (MAX_SOCK_TCP - SOCK_ID_TCP); id++)
+	{
+		if(server_list[id] == this)
+			server_list[id] = NULL;
+	}
+}
+
+void PhpocServer::setBufferSize(uint16_t txbuf, uint16_t rxbuf)
+{
+	opt_txbuf = txbuf;
+	opt_rxbuf = rxbuf;
+}
+
+void PhpocServer::setNoDelay(bool nodelay)
+{
+	opt_nodelay = nodelay ? 2 : 1;
 }
 
-void PhpocServer::listen()
+void PhpocServer::setBacklog(uint8_t count)
+{
+	if(count < 1)
+		count = 1;
+
+	if(count > (MAX_SOCK_TCP - SOCK_ID_TCP))
+		count = MAX_SOCK_TCP - SOCK_ID_TCP;
+
+	listen_backlog = count;
+}
+
+int PhpocServer::listen()
 {
 	uint8_t sock_id, state;
 
@@ -59,6 +111,10 @@ void PhpocServer::listen()
 #ifdef INCLUDE_NET_CACHE
 		nc_update(sock_id, 0);
 		state = nc_tcp_state[sock_id];
+
+		/* closing socket keeps last state until it reaches TCP_CLOSED */
+		if(nc_close_mask & (1 << sock_id))
+			continue;
 #else
 		state = Phpoc.tcpIoctlReadInt(F("state"), sock_id);
 #endif
@@ -73,7 +129,13 @@ void PhpocServer::listen()
 		//if((Sppc.flags & PF_LOG_NET) && Serial)
 		//	sppc_printf(F("log> phpoc_server : socket not available\r\n"));
 #endif
-		return;
+		listen_wait = 1;
+#ifdef INCLUDE_NET_CACHE
+		listen_seq = nc_state_seq;
+#else
+		listen_seq = PhpocClient::conn_flags; /* retry when a connection is closed */
+#endif
+		return 0;
 	}
 
 	switch(server_api)
@@ -94,6 +156,8 @@ void PhpocServer::listen()
 			break;
 	}
 
+	PhpocClient::sock_opt(sock_id, opt_txbuf, opt_rxbuf, opt_nodelay);
+
 #ifdef INCLUDE_LIB_V1
 	if(Sppc.flags & PF_SYNC_V1)
 		Phpoc.command(F("tcp%u listen %u"), sock_id, listen_port);
@@ -106,10 +170,8 @@ void PhpocServer::listen()
 
 	if(!Sppc.errno)
 	{
-		server_port[sock_id] = listen_port;
-
-		if(server_api == SERVER_API_WS)
-			server_ws_path[sock_id] = listen_ws_path;
+		sock_mask |= (1 << sock_id);
+		listen_mask |= (1 << sock_id);
 
 #ifdef PF_LOG_NET
 		if((Sppc.flags & PF_LOG_NET) && Serial)
@@ -119,19 +181,55 @@ void PhpocServer::listen()
 #ifdef INCLUDE_NET_CACHE
 		nc_init(sock_id, TCP_LISTEN);
 #endif
+		return 1;
+	}
+
+	return 0;
+}
+
+/* register server for Phpoc.poll() */
+void PhpocServer::attach()
+{
+	uint8_t id, empty_id;
+
+	empty_id = MAX_SOCK_TCP - SOCK_ID_TCP;
+
+	for(id = 0; id < (MAX_SOCK_TCP - SOCK_ID_TCP); id++)
+	{
+		if(server_list[id] == this)
+			return;
+
+		if(!server_list[id] && (empty_id == (MAX_SOCK_TCP - SOCK_ID_TCP)))
+			empty_id = id;
+	}
+
+	if(empty_id < (MAX_SOCK_TCP - SOCK_ID_TCP))
+		server_list[empty_id] = this;
+}
+
+void PhpocServer::accept_all()
+{
+	uint8_t id;
+
+	for(id = 0; id < (MAX_SOCK_TCP - SOCK_ID_TCP); id++)
+	{
+		if(server_list[id])
+			server_list[id]->accept();
 	}
 }
 
 void PhpocServer::begin()
 {
 	server_api = SERVER_API_TCP;
-	listen();
+	attach();
+	accept();
 }
 
 void PhpocServer::beginTelnet()
 {
 	server_api = SERVER_API_TELNET;
-	listen();
+	attach();
+	accept();
 }
 
 void PhpocServer::beginWebSocket(const char *path, const char *proto)
@@ -147,7 +245,8 @@ void PhpocServer::beginWebSocket(const char *path, const char *proto)
 	else
 		listen_ws_proto = "text.phpoc";
 
-	listen();
+	attach();
+	accept();
 }
 
 void PhpocServer::beginWebSocketText(const char *path, const char *proto)
@@ -162,85 +261,178 @@ void PhpocServer::beginWebSocketBinary(const char *path, const char *proto)
 	beginWebSocket(path, proto);
 }
 
-void PhpocServer::accept()
+/* apply new tcp state of a socket owned by this server */
+void PhpocServer::update(uint8_t sock_id, uint8_t state)
 {
-	uint8_t sock_id, state, listening;
+	PhpocClient client(sock_id);
 
-	if(!listen_port)
+	if(state == TCP_LISTEN)
+	{
+		listen_mask |= (1 << sock_id);
 		return;
+	}
 
-	listening = 0;
+	listen_mask &= ~(1 << sock_id);
 
-	/* find listening socket & close disconnected socket */
-	for(sock_id = SOCK_ID_TCP; sock_id < MAX_SOCK_TCP; sock_id++)
+	if((state < TCP_LISTEN) || (state > TCP_CONNECTED))
 	{
-		if(listen_port == server_port[sock_id])
+		/* PHPoC firmware doesn't support tcp CLOSE_WAIT state */
+		if(client.available())
+			close_mask |= (1 << sock_id); /* checked again by next accept() */
+		else
 		{
-			PhpocClient client(sock_id);
-
-			if((server_api == SERVER_API_WS) && (listen_ws_path != server_ws_path[sock_id]))
-				continue;
-
 #ifdef INCLUDE_NET_CACHE
-			nc_update(sock_id, 0);
-			state = nc_tcp_state[sock_id];
+			/* socket closed or being closed by client.stop() must not be closed again */
+			if((state == TCP_CLOSED) || (nc_close_mask & (1 << sock_id)))
 #else
-			state = Phpoc.tcpIoctlReadInt(F("state"), sock_id);
+			if(state == TCP_CLOSED)
 #endif
-
-			if(state == TCP_LISTEN)
-				listening = 1;
+				client.conn_flags &= ~(1 << sock_id);
 			else
-			if((state < TCP_LISTEN) || (state > TCP_CONNECTED))
 			{
-				/* PHPoC firmware doesn't support tcp CLOSE_WAIT state */
-				if(!client.available())
-				{
-					client.stop(); /* conn_flags is cleared in function client.stop() */
-					server_port[sock_id] = 0;
-					server_ws_path[sock_id] = NULL;
-				}
+				/* don't wait close sequence here, NetCache releases the socket */
+				client.stopAsync(); /* conn_flags is cleared in function client.stopAsync() */
 			}
-			else
-			if(state == TCP_CONNECTED)
-			{
-				if(!(client.conn_flags & (1 << sock_id)))
-				{
+
+			sock_mask &= ~(1 << sock_id);
+			close_mask &= ~(1 << sock_id);
+		}
+	}
+	else
+	if(state == TCP_CONNECTED)
+	{
+		if(!(client.conn_flags & (1 << sock_id)))
+		{
 #ifdef PF_LOG_NET
-					if((Sppc.flags & PF_LOG_NET) && Serial)
-						sppc_printf(F("log> phpoc_server: connected %d\r\n"), sock_id);
+			if((Sppc.flags & PF_LOG_NET) && Serial)
+				sppc_printf(F("log> phpoc_server: connected %d\r\n"), sock_id);
 #endif
-					client.conn_flags |= (1 << sock_id);
-				}
-			}
+			client.conn_flags |= (1 << sock_id);
 		}
 	}
-
-	if(!listening)
-		listen();
 }
 
-PhpocClient PhpocServer::available()
+void PhpocServer::accept()
 {
 	uint8_t sock_id;
+#ifdef INCLUDE_NET_CACHE
+	uint8_t events;
+#endif
 
-	accept();
+	if(!listen_port)
+		return;
 
-	for(sock_id = SOCK_ID_TCP; sock_id < MAX_SOCK_TCP; sock_id++)
+#ifdef INCLUDE_NET_CACHE
+	/* visit only sockets whose state has changed.
+	 * idle server sends no command until a timer of its sockets expires.
+	 */
+	nc_update_mask(sock_mask);
+
+	events = (nc_state_mask & sock_mask) | close_mask;
+	nc_state_mask &= ~events;
+
+	for(sock_id = SOCK_ID_TCP; events && (sock_id < MAX_SOCK_TCP); sock_id++)
 	{
-		if(listen_port == server_port[sock_id])
+		if(events & (1 << sock_id))
 		{
-			PhpocClient client(sock_id);
+			events &= ~(1 << sock_id);
+			update(sock_id, nc_tcp_state[sock_id]);
+		}
+	}
+#else
+	for(sock_id = SOCK_ID_TCP; sock_id < MAX_SOCK_TCP; sock_id++)
+	{
+		if(sock_mask & (1 << sock_id))
+			update(sock_id, Phpoc.tcpIoctlReadInt(F("state"), sock_id));
+	}
+#endif
 
-			if((server_api == SERVER_API_WS) && (listen_ws_path != server_ws_path[sock_id]))
-				continue;
+	/* no socket can be free again until some socket changes its state.
+	 * saturated server doesn't scan all sockets on every call.
+	 */
+#ifdef INCLUDE_NET_CACHE
+	if(listen_wait && (listen_seq == nc_state_seq))
+		return;
+#else
+	if(listen_wait && !(listen_seq & ~PhpocClient::conn_flags))
+	{
+		listen_seq |= PhpocClient::conn_flags; /* connections made after the failure */
+		return;
+	}
+#endif
 
-			if(client.available())
-				return client;
-		}
+	listen_wait = 0;
+
+	/* keep backlog sockets listening, refill as soon as a socket is connected */
+	while(mask_count(listen_mask) < listen_backlog)
+	{
+		if(!listen())
+			break;
 	}
+}
+
+/* return bitmask of owned sockets which have rx data, bit n : socket n */
+uint8_t PhpocServer::ready_mask()
+{
+	uint8_t sock_id, mask;
 
-	return PhpocClient(MAX_SOCK_TCP);
+	mask = 0;
+
+	for(sock_id = SOCK_ID_TCP; sock_id < MAX_SOCK_TCP; sock_id++)
+	{
+		if(!(sock_mask & (1 << sock_id)))
+			continue;
+
+#ifdef INCLUDE_NET_CACHE
+		/* rxlen is renewed by accept() or Phpoc.poll() */
+		if(nc_read_len[sock_id] || nc_tcp_rxlen[sock_id])
+#else
+		if(Phpoc.tcpIoctlReadInt(F("rxlen"), sock_id) > 0)
+#endif
+			mask |= (1 << sock_id);
+	}
+
+	return mask;
+}
+
+/* sockets are served round-robin from the socket after the last returned one,
+ * so a busy client can't starve the others.
+ */
+PhpocClient PhpocServer::available()
+{
+	uint8_t sock_id, count, mask;
+
+	accept();
+
+	mask = ready_mask();
+
+	if(!mask)
+		return PhpocClient(MAX_SOCK_TCP);
+
+	sock_id = next_sock_id;
+
+	for(count = 0; count < (MAX_SOCK_TCP - SOCK_ID_TCP); count++)
+	{
+		if(mask & (1 << sock_id))
+			break;
+
+		if(++sock_id == MAX_SOCK_TCP)
+			sock_id = SOCK_ID_TCP;
+	}
+
+	next_sock_id = sock_id + 1;
+
+	if(next_sock_id == MAX_SOCK_TCP)
+		next_sock_id = SOCK_ID_TCP;
+
+	return PhpocClient(sock_id);
+}
+
+uint8_t PhpocServer::availableAll()
+{
+	accept();
+
+	return ready_mask();
 }
 
 size_t PhpocServer::write(uint8_t byte)
@@ -259,16 +451,12 @@ size_t PhpocServer::write(const uint8_t *buf, size_t size)
 
 	for(sock_id = SOCK_ID_TCP; sock_id < MAX_SOCK_TCP; sock_id++)
 	{
-		if(listen_port == server_port[sock_id])
+		if(sock_mask & (1 << sock_id))
 		{
 			PhpocClient client(sock_id);
 
-			if((server_api == SERVER_API_WS) && (listen_ws_path != server_ws_path[sock_id]))
-				continue;
-
 #ifdef INCLUDE_NET_CACHE
-			nc_update(sock_id, 0);
-			state = nc_tcp_state[sock_id];
+			state = nc_tcp_state[sock_id]; /* renewed by accept() */
 #else
 			state = Phpoc.tcpIoctlReadInt(F("state"), sock_id);
 #endif
@@ -41,32 +41,52 @@
 class PhpocServer : public Server
 {
 	private:
-		static uint16_t server_port[MAX_SOCK_TCP];
-		static const char *server_ws_path[MAX_SOCK_TCP];
+		static PhpocServer *server_list[MAX_SOCK_TCP - SOCK_ID_TCP];
+		static void accept_all();
 
 	private:
 		uint16_t listen_port;
+		uint8_t listen_backlog; /* number of sockets listening at once */
 		const char *listen_ws_path;
 		const char *listen_ws_proto;
 		uint8_t server_api;
 		uint8_t ws_mode;
-		void listen();
+		uint16_t opt_txbuf; /* 0 : default size of shield */
+		uint16_t opt_rxbuf;
+		uint8_t opt_nodelay; /* 0 : default, 1 : delayed send(Nagle), 2 : no delay */
+		uint8_t sock_mask;   /* sockets owned by this server */
+		uint8_t listen_mask; /* sockets in TCP_LISTEN state */
+		uint8_t close_mask;  /* closed sockets waiting until rx data is read */
+		uint8_t next_sock_id; /* first socket checked by next available() */
+		uint8_t listen_wait;  /* listen() failed, no socket was free */
+		uint8_t listen_seq;   /* socket change snapshot taken when listen() failed */
+		int listen();
+		void update(uint8_t sock_id, uint8_t state);
 		void accept();
+		void attach();
+		uint8_t ready_mask();
 
 	public:
 		void beginTelnet();
 		void beginWebSocket(const char *path, const char *proto = NULL);
 		void beginWebSocketText(const char *path, const char *proto = NULL);
 		void beginWebSocketBinary(const char *path, const char *proto = NULL);
+		void setBufferSize(uint16_t txbuf, uint16_t rxbuf); /* call before begin(), 0 : default */
+		void setNoDelay(bool nodelay); /* call before begin() */
+		void setBacklog(uint8_t count); /* call before begin(), default 1 */
+		uint8_t availableAll(); /* bit n is set if client on socket n has data, PhpocClient(n) */
 
 	public:
 		/* Arduino EthernetServer compatible public member functions */
 		PhpocServer(uint16_t port);
+		~PhpocServer();
 		PhpocClient available();
 		virtual void begin();
 		virtual size_t write(uint8_t byte);
 		virtual size_t write(const uint8_t *buf, size_t size);
 		using Print::write;
+
+		friend class PhpocClass;
 };
 
 #endif
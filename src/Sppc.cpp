@@ -62,6 +62,7 @@ char SppcClass::readstr_buf[READSTR_BUF_SIZE];
 uint16_t SppcClass::flags;
 uint16_t SppcClass::pkg_ver_id;
 uint16_t SppcClass::errno;
+uint16_t SppcClass::wait_timeout;
 
 /* SPI_MODE3 : clock idle high, capture data on the first clock edge */
 static const SPISettings SPI_PHPOC_SETTINGS(1000000, MSBFIRST, SPI_MODE3);
@@ -251,7 +252,7 @@ int SppcClass::spi_cmd_write(uint16_t cmd, const uint8_t *wbuf, size_t wlen, boo
 uint16_t SppcClass::sppc_request(const char *wbuf, int wlen)
 {
 	uint8_t retval64[8];
-	uint16_t status;
+	uint16_t status, t1_ms16;
 	long retval;
 
 	errno = 0;
@@ -274,6 +275,8 @@ uint16_t SppcClass::sppc_request(const char *wbuf, int wlen)
 	spi_cmd_read(CMD_READ_B0, NULL, spi_cmd_txlen(BID_CMD));
 	spi_cmd_read(CMD_READ_B1, NULL, spi_cmd_txlen(BID_DATA));
 
+	t1_ms16 = (uint16_t)millis();
+
 _again:
 	spi_cmd_write(CMD_WRITE_B0, (const uint8_t *)wbuf, wlen, false);
 
@@ -293,10 +296,15 @@ _again:
 
 	if(retval < 0)
 	{
-		if((int)retval == -EAGAIN)
+		if(((int)retval == -EAGAIN) && !(flags & PF_NO_RETRY))
 		{
-			delay(EAGAIN_WAIT_MS);
-			goto _again;
+			if(!wait_timeout || ((uint16_t)((uint16_t)millis() - t1_ms16) < wait_timeout))
+			{
+				delay(EAGAIN_WAIT_MS);
+				goto _again;
+			}
+
+			retval = -ETIMEDOUT;
 		}
 
 #ifdef PF_LOG_SPI
@@ -376,6 +384,11 @@ int SppcClass::write(const uint8_t *wbuf, size_t wlen)
 	return sppc_write_data((const uint8_t *)wbuf, wlen, false);
 }
 
+int SppcClass::write_P(const uint8_t *wbuf, size_t wlen)
+{
+	return sppc_write_data(wbuf, wlen, true);
+}
+
 int SppcClass::read(uint8_t *rbuf, size_t rlen)
 {
 	uint16_t status;
@@ -46,6 +46,7 @@
 #define PF_LOG_SPI   0x0100
 #define PF_LOG_NET   0x0200
 #define PF_LOG_APP   0x0400
+#define PF_NO_RETRY  0x1000 /* command returns EAGAIN error without retry */
 
 /* SPPC protocol flags */
 #define S2M_FLAG_SYNC 0x8000 /* SPI SYNC ok */
@@ -103,6 +104,7 @@
 #define ENETDOWN       100  /* Network is down */
 #define ENETUNREACH    101  /* Network is unreachable */
 #define ECONNRESET     104  /* Connection reset by peer */
+#define ENOTCONN       107  /* Transport endpoint is not connected */
 #define ETIMEDOUT      110  /* Connection timed out */
 #define ECONNREFUSED   111  /* Connection refused */
 #define EHOSTUNREACH   113  /* No route to host */
@@ -157,11 +159,13 @@ class SppcClass
 		static uint16_t flags;
 		static uint16_t pkg_ver_id;
 		static uint16_t errno;
+		static uint16_t wait_timeout; /* time limit of blocking calls, 0 : no limit */
 		uint16_t command(const __FlashStringHelper *format, ...);
 		uint16_t command(const char *format, ...);
 		int write(const __FlashStringHelper *wstr);
 		int write(const char *wstr);
 		int write(const uint8_t *wbuf, size_t wlen);
+		int write_P(const uint8_t *wbuf, size_t wlen); /* wbuf in PROGMEM */
 		int read(uint8_t *rbuf, size_t rlen);
 		char *readString(void);
 		void logFlush(uint8_t id);